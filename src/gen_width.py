@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# 根据 Python 自带的 Unicode 数据生成显示宽度表 vorpal_width.h
+# 两级查表：第一级以码点高位选出 256 个码点的块，相同的块只保存一份；
+# 第二级每个码点占 2 位，取值 0、1、2 列
+import sys
+import unicodedata
+
+BLOCK = 256
+MAXCP = 0x110000
+
+
+def width(cp):
+    # 东亚宽字符和全角字符占两列，CJK 扩展平面中未分配的码点同样按宽字符处理
+    if 0x1160 <= cp <= 0x11FF or cp == 0x200B:
+        return 0
+    ch = chr(cp)
+    cat = unicodedata.category(ch)
+    if cat in ("Mn", "Me") or (cat == "Cf" and cp != 0x00AD):
+        return 0
+    if unicodedata.east_asian_width(ch) in ("W", "F"):
+        return 2
+    if cat == "Cn" and (0x20000 <= cp <= 0x2FFFD or 0x30000 <= cp <= 0x3FFFD):
+        return 2
+    return 1
+
+
+def main():
+    out = sys.argv[1] if len(sys.argv) > 1 else "vorpal_width.h"
+    blocks = []
+    index = {}
+    stage1 = []
+    for base in range(0, MAXCP, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i >> 2] |= width(base + i) << ((i & 3) * 2)
+        key = bytes(packed)
+        if key not in index:
+            index[key] = len(blocks)
+            blocks.append(key)
+        stage1.append(index[key])
+    if len(blocks) > 256:
+        sys.exit("too many distinct blocks: %d" % len(blocks))
+
+    with open(out, "w") as f:
+        f.write("// 由 gen_width.py 生成，Unicode %s，不要手动修改\n\n" % unicodedata.unidata_version)
+        f.write("#define VEITOR_WIDTH_BLOCK %d\n\n" % BLOCK)
+        f.write("static const unsigned char widthStage1[%d] = {\n" % len(stage1))
+        for i in range(0, len(stage1), 24):
+            f.write("\t" + ",".join(str(b) for b in stage1[i:i + 24]) + ",\n")
+        f.write("};\n\n")
+        f.write("static const unsigned char widthStage2[%d][%d] = {\n" % (len(blocks), BLOCK // 4))
+        for b in blocks:
+            f.write("\t{" + ",".join("0x%02x" % x for x in b) + "},\n")
+        f.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
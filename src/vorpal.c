@@ -7,16 +7,35 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
+
+// 构建时由 gen_width.py 生成的 Unicode 显示宽度表
+#include "vorpal_width.h"
+
+#if defined(__x86_64__)
+#define VEITOR_X86
+#include <immintrin.h>
+#endif
  
 #pragma endregion
 
@@ -25,6 +44,49 @@
 
 #define VEITOR_VERSION "0.0.1"
 #define VEITOR_TAP_STOP 8
+// 超过该大小的文件自动以只读视图模式打开
+#define VEITOR_VIEW_THRESHOLD (64 << 20)
+// 后台加载第一段扫描的字节数，之后每段加倍直到 VEITOR_LOAD_SEGMENT
+#define VEITOR_INDEX_SPAN (64 << 10)
+// 行索引分块存放，每块 1 << VEITOR_LINEBLK_SHIFT 项，已发布的块不再移动
+#define VEITOR_LINEBLK_SHIFT 16
+// 不小于该大小的视图模式文件把行索引缓存到 $XDG_CACHE_HOME/veitor，重新打开时不再扫描；
+// 环境变量 VEITOR_CACHE=0 关闭缓存
+#define VEITOR_CACHE_MIN (16 << 20)
+// 判断文件只是追加时，比较已缓存部分末尾的字节数
+#define VEITOR_CACHE_SAMPLE 4096
+#define VEITOR_CACHE_MAGIC "VEIDX1\n"
+// 普通模式加载时每段扫描的字节数
+#define VEITOR_LOAD_SEGMENT (64 << 20)
+// 并行建立索引时每个任务至少扫描的字节数
+#define VEITOR_INDEX_CHUNK (1 << 20)
+// 行文本分配器每块的大小
+#define VEITOR_ARENA_BLOCK (1 << 20)
+// render 缓存的字节上限，当前帧可见的行不受限制
+#define VEITOR_RENDER_CACHE_MAX (8 << 20)
+// 按键队列的长度
+#define VEITOR_KEYQ_SIZE 256
+// 等待转义序列后续字节的时间（毫秒）
+#define VEITOR_ESC_TIMEOUT_MS 50
+// 输入积压时最多连续跳过多久不刷新（毫秒）
+#define VEITOR_MAX_SKIP_MS 100
+// 超过该长度的行建立列索引，每隔 VEITOR_COLIDX_STEP 字节记录一次显示列
+#define VEITOR_COLIDX_MIN (8 << 10)
+#define VEITOR_COLIDX_STEP 1024
+// 搜索时每次读取的字节数
+#define VEITOR_SEARCH_CHUNK (4 << 20)
+// 撤销记录默认占用的内存上限，可用环境变量 VEITOR_UNDO_MB 修改
+#define VEITOR_UNDO_MAX (16 << 20)
+// 跟随模式每次读取追加内容的字节数
+#define VEITOR_FOLLOW_CHUNK (1 << 20)
+// 读取管道输入时每次最多处理的字节数，之后先刷新界面
+#define VEITOR_STREAM_BUDGET (4 << 20)
+// 保存时每次 writev 最多提交的片段数
+#define VEITOR_SAVE_IOV 1024
+// 高亮时最多补算的行数，跳到更远处时跳过中间的行，沿用其中保存的状态
+#define VEITOR_HL_SYNC 50000
+// 统计耗时分布的桶数，第 i 个桶为小于 2^i 微秒
+#define VEITOR_STATS_BUCKETS 24
 
 // (a & 0x1f) =  (11000001 & 00011111) = 1
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -32,6 +94,7 @@
 // 配置按键绑定枚举变量
 enum editorKey
 {
+	BACKSPACE = 127,
 	ARROW_LEFT = 1000,
 	ARROW_RIGHT,
 	ARROW_UP,
@@ -40,23 +103,329 @@ enum editorKey
 	END_KEY,
 	PAGE_UP,
 	PAGE_DOWN,
-	DEL_KEY
+	DEL_KEY,
+	TERM_REPLY	// 终端对查询的应答，不是按键
+};
+
+// 高亮类型，对应不同的前景色
+enum editorHighlight
+{
+	HL_NORMAL = 0,
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2,
+	HL_STRING,
+	HL_NUMBER
 };
 
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+// 行末词法状态，最高位表示需要重新计算
+#define HL_STATE_COMMENT 1
+#define HL_STATE_DIRTY 0x80
+
 #pragma endregion
 
 /*** data **/
 #pragma region
 
+// 行的分类，取得 chars 时计算一次
+#define ROW_ASCII 1		// 只有 ASCII 字符，列数等于字节数
+#define ROW_TAB 2		// 含有 tab
+#define ROW_INVALID 4	// 含有不合法的 UTF-8 序列
+#define ROW_ALIAS 8		// render 直接指向 chars，没有单独分配
+
 // 存储一行文本
 typedef struct erow
 {
 	int size;
 	int rsize;
+	int rcslot;		// render 在缓存中的位置，-1 表示尚未生成
+	unsigned char flags;
 	char *chars;
 	char *render;
+	int *colidx;	// 长行的列索引，第 k 项为字节 k * VEITOR_COLIDX_STEP 处的显示列
+	unsigned char *hl;	// render 每个字节的高亮类型，与 render 一起生成和释放
 } erow;
 
+// 文件类型的高亮规则
+struct editorSyntax
+{
+	char *filetype;
+	char **filematch;	// 以 . 开头的按扩展名匹配，否则按文件名匹配
+	char **keywords;	// 以 | 结尾的是第二类关键字
+	char *singleline_comment_start;
+	char *multiline_comment_start;
+	char *multiline_comment_end;
+	int flags;
+};
+
+// render 缓存项，按最近使用顺序串成双向链表
+typedef struct renderEntry
+{
+	int row;			// 所属行号
+	int prev, next;
+	size_t bytes;
+	unsigned int frame;	// 最近一次使用时的帧号
+} renderEntry;
+
+// 块式分配器：逐块向后分配，只能整体释放
+typedef struct arenaBlock
+{
+	struct arenaBlock *next;
+	size_t used;
+	size_t cap;
+	char data[];
+} arenaBlock;
+
+typedef struct arena
+{
+	arenaBlock *head;
+	size_t total;		// 已申请的块总大小
+} arena;
+
+// 存储文本内容的结构体，清空时保留容量以便重复使用
+struct abuf
+{
+	char *b;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+#ifdef VEITOR_STATS
+// 计时的阶段
+enum statsStage
+{
+	STAT_OPEN = 0,	// editorOpen
+	STAT_RENDER,	// 生成一行的 render 和高亮
+	STAT_DRAW,		// editorDrawRows
+	STAT_WRITE,		// 向终端写入一帧
+	STAT_FRAME,		// 整次刷新
+	STAT_STAGES
+};
+
+// 一个阶段的次数、耗时和分布
+typedef struct statsTimer
+{
+	unsigned long count;
+	unsigned long total_ns;
+	unsigned long max_ns;
+	unsigned long hist[VEITOR_STATS_BUCKETS];
+} statsTimer;
+
+// 编译时打开 VEITOR_STATS 才计时，否则宏为空，没有额外开销
+#define STATS_START(t) struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t)
+#define STATS_STOP(stage, t) statsRecord(stage, &t)
+#define STATS_COUNT(field, n) (E.stats.field += (n))
+#else
+#define STATS_START(t)
+#define STATS_STOP(stage, t)
+#define STATS_COUNT(field, n)
+#endif
+
+// 运行统计
+struct editorStats
+{
+	unsigned long frames;			// 刷新次数
+	unsigned long keys;				// 处理的按键数
+	struct timespec open_start;		// 开始打开文件的时间
+	long first_frame_ms;			// 打开后第一次绘制出文本的耗时，-1 表示尚未绘制
+	long load_ms;					// 打开到全部加载完成的耗时
+	unsigned long bytes_written;	// 写入终端的总字节数
+	unsigned long writes;			// 写入终端的次数
+	int frame_bytes;				// 最近一次刷新写入的字节数
+#ifdef VEITOR_STATS
+	statsTimer timers[STAT_STAGES];
+	unsigned long rows_rendered;	// 生成 render 的行数
+	bool overlay;					// 在消息栏显示统计
+	char *dump;						// 退出时写入 JSON 的文件
+#endif
+};
+
+// 线程池，调用线程也参与执行任务
+typedef struct workerPool
+{
+	pthread_t *threads;
+	int nthreads;		// 不含调用线程
+	pthread_mutex_t lock;
+	pthread_mutex_t runlock;	// 同一时间只执行一批任务
+	pthread_cond_t work, done;
+	void (*fn)(void *arg, int task);
+	void *arg;
+	int ntasks, next, finished;
+} workerPool;
+
+// 后台加载线程，按段建立行索引并发布已完成的行数
+typedef struct fileLoader
+{
+	pthread_t thread;
+	bool active;
+	int notify[2];		// 每发布一段向管道写入一个字节
+	int rows;			// 已发布的行数，原子读写
+	size_t scanned;		// 已扫描的字节数，原子读写
+	bool done;			// 行索引已完成，原子读写
+	bool finished;		// 缓存也已写完，线程可以回收，原子读写
+	bool cancel;		// 原子读写
+} fileLoader;
+
+// 行索引缓存的文件头，之后是文件的绝对路径和各行长度的变长编码（每字节 7 位，低位在前）
+typedef struct indexCacheHeader
+{
+	char magic[8];
+	uint64_t dev, ino;
+	uint64_t size;			// 建立索引时的文件大小
+	int64_t mtime, mtimensec;
+	uint64_t covered;		// 最后一个完整行之后的偏移，只缓存此前的行
+	uint64_t rows;
+	uint64_t datalen;		// 变长编码的字节数
+	uint64_t sample;		// covered 之前 VEITOR_CACHE_SAMPLE 字节的哈希
+	uint32_t pathlen;
+	uint32_t pad;
+} indexCacheHeader;
+
+// 打开文件时找到的行索引缓存，由后台加载线程解码和更新
+typedef struct indexCache
+{
+	char *path;				// 缓存文件的路径，不使用缓存时为 NULL
+	char *file;				// 被索引文件的绝对路径
+	struct stat st;
+	unsigned char *map;
+	size_t maplen;
+	const unsigned char *data;	// 缓存有效时指向行长度的编码
+	size_t datalen;
+	int rows;
+	size_t covered;
+} indexCache;
+
+// 片段表中的一个片段，同时是按文档顺序排列的 treap 节点
+typedef struct piece
+{
+	bool add;			// 位于追加缓冲区还是原始文本
+	size_t start, len;	// 在所属文本中的位置
+	int nl;				// 片段内的换行数
+	size_t bytes;		// 子树的字节数
+	int nls;			// 子树的换行数
+	int left, right;
+	unsigned int prio;
+} piece;
+
+// 片段表：原始文本保持不变，插入的内容追加到 add，文档由片段依次拼接而成
+typedef struct pieceTable
+{
+	bool active;		// 第一次编辑时建立
+	piece *node;
+	int cap, used;
+	int free;			// 空闲节点链表，通过 left 相连
+	int root;
+	int orignl;			// 原始文本中以换行结尾的行数
+	struct abuf add;
+	size_t *addnl;		// 追加缓冲区中各个换行的位置
+	int addnlcount, addnlcap;
+} pieceTable;
+
+// 撤销记录引用的一段文本，内容仍在原始文本或追加缓冲区中
+typedef struct undoSpan
+{
+	bool add;
+	size_t start, len;
+	int nl;
+} undoSpan;
+
+// 一次插入或删除，连续输入合并为一条
+typedef struct undoRecord
+{
+	struct undoRecord *prev, *next;
+	arenaBlock *block;	// 记录所在的块
+	bool insert;
+	bool back;			// 连续退格产生的删除，片段按文档倒序存放
+	size_t off, len;	// 在文档中的位置和长度
+	int nspans;
+	undoSpan spans[];
+} undoRecord;
+
+// 撤销日志：记录依次追加到分配器中，超过上限时丢弃最旧的块
+typedef struct undoLog
+{
+	arena mem;
+	undoRecord *first, *last;
+	undoRecord *top;	// 最近一次生效的记录，之后的是可重做的记录
+	size_t cap;
+	bool sealed;		// 下一次编辑不与上一条合并
+} undoLog;
+
+// 后台统计匹配数的线程，修改查询时取消重来
+typedef struct searchCounter
+{
+	pthread_t thread;
+	bool active;
+	int notify[2];		// 每处理一段向管道写入一个字节
+	char *query;
+	size_t qlen;
+	size_t from;		// 本次从这里开始统计，之前的匹配已计入 count
+	size_t total;		// 统计到这里为止：开始统计时的文档大小
+	size_t count;		// 已找到的匹配数，原子读写
+	bool done;			// 原子读写
+	bool cancel;		// 原子读写
+} searchCounter;
+
+// 过滤视图：只显示包含 pattern 的行，rows 是按顺序排列的行号
+typedef struct rowFilter
+{
+	bool active;
+	char *pattern;
+	int *rows;
+	int nrows, cap;
+} rowFilter;
+
+// 建立过滤结果时一个任务处理的范围
+typedef struct filterChunk
+{
+	const char *q;
+	size_t m;
+	size_t from, to;	// 扫描文档 [from, to)
+	const int *in;		// 或者筛选上一次结果中的若干行
+	int nin;
+	int *rows;
+	int n, cap;
+} filterChunk;
+
+// 保存时积累待写出的片段，满了再一起 writev
+typedef struct saveWriter
+{
+	int fd;
+	struct iovec iov[VEITOR_SAVE_IOV];
+	int niov;
+	bool nocopy;		// 不支持 copy_file_range 时改为从映射写出
+	size_t written;
+} saveWriter;
+
+// 跟随模式：文件增长时只读取新增的部分，截断或轮转后重新打开
+typedef struct fileFollower
+{
+	bool active;
+	int inotify;		// inotify 描述符，未开启时为 -1
+	int filewd, dirwd;
+	dev_t dev;			// 当前打开的文件
+	ino_t ino;
+	size_t size;		// 已读入的字节数
+	bool partial;		// 最后一行没有换行，追加时与新内容合并
+	struct abuf part;	// 普通模式下没有换行的最后一行，最后一行直接引用，收到换行后才复制到 rowarena
+} fileFollower;
+
+// 从管道逐步读入的输入
+typedef struct streamInput
+{
+	int fd;				// 读完后为 -1
+	struct abuf tail;	// 还没有遇到换行的部分
+	int keep;			// 大于 0 时只保留最后 keep 行
+	int dropped;		// 已丢弃的行数
+	size_t bytes;		// 已读入的字节数
+} streamInput;
+
 // 定义终端配置结构体
 struct editorConfig
 {
@@ -68,7 +437,58 @@ struct editorConfig
 	int screencols;  // 终端列数
 	int numrows;	// 打开文本的行数
 	erow *row;		 // 存储文本的数组
+	int rowcap;		// row 数组容量，按倍数增长
+	arena rowarena;	// 行的 chars 从这里分配
+	renderEntry *rcache;	// render 缓存，超过上限时淘汰最久未用的行
+	int rcachecap;
+	int rcachehead, rcachetail, rcachefree;
+	size_t rcachebytes;
+	unsigned int frame;	// 已绘制的帧数
+	// 终端当前显示内容的副本，刷新时只输出发生变化的行
+	struct abuf *shadow;
+	struct abuf outbuf;		// 每帧的输出缓冲区，跨帧复用
+	struct abuf linebuf;	// 生成单行内容的缓冲区
+	int shadowrows;
+	bool shadowvalid;
+	int shadowcx, shadowcy;	// 终端上光标的位置
+	int shadowrowoff;		// 副本对应的行偏移量，变化不多时让终端滚动
+	bool syncupdate;		// 终端支持同步更新（DEC 2026），整帧输出完再显示
+	struct editorStats stats;
+	// 输入缓冲区与解码后的按键队列
+	char inbuf[256];
+	int inlen;
+	int keyq[VEITOR_KEYQ_SIZE];
+	int keyqhead, keyqlen;
+	int winchpipe[2];	// SIGWINCH 通知事件循环的管道
+	workerPool pool;
 	char *filename;
+	bool readonly;		// -v 打开时禁止编辑
+	int dirty;			// 打开后的修改次数
+	pieceTable pt;		// 编辑后的文本，行从这里生成
+	undoLog undo;
+	searchCounter search;
+	rowFilter filter;	// 过滤时 cy 和 rowoff 是 filter.rows 中的下标
+	struct editorSyntax *syntax;	// 当前文件的高亮规则，NULL 表示不高亮
+	unsigned char *hlstate;	// 每行行末的词法状态
+	int hlstatecap;
+	int hldirty;		// 此前各行的状态都已确定（hlskip 起跳过的行除外）
+	int hlskip;			// 向后跳转时跳过补算的行 [hlskip, hldirty) 的起点，没有时为 -1
+	// 只读视图模式：文件整体 mmap，只保存行偏移索引，按需生成 erow
+	bool viewmode;
+	char *map;
+	size_t mapsize;
+	int mapfd;			// 映射的文件保持打开，保存时从这里复制未修改的部分
+	size_t **lineblk;	// 分块的行起始偏移，共 numrows + 1 项
+	int lineblkcount;
+	bool indexed;		// 是否已索引到文件末尾
+	fileLoader loader;
+	indexCache icache;
+	fileFollower follow;
+	streamInput stream;
+	erow *rowcache;		// 已生成的行，按行号直接映射到槽位
+	int *rowcacheidx;
+	struct abuf *rowcachebuf;	// 跨片段的行复制到槽位自己的缓冲区
+	int rowcachesize;
 	char statusmsg[80];
 	time_t statusmsg_time;
 	struct termios orig_termios;
@@ -78,6 +498,73 @@ struct editorConfig E;
 
 #pragma endregion
 
+/*** filetypes ***/
+#pragma region
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+	"switch", "if", "while", "for", "break", "continue", "return", "else",
+	"struct", "union", "typedef", "static", "enum", "class", "case", "default",
+	"do", "goto", "sizeof", "const", "volatile", "extern", "inline",
+	"#include", "#define", "#if", "#ifdef", "#ifndef", "#else", "#endif", "#pragma",
+	"int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+	"void|", "short|", "bool|", "size_t|", "NULL|", "true|", "false|", NULL};
+
+char *CONF_HL_extensions[] = {".conf", ".cfg", ".ini", ".toml", ".yaml", ".yml", NULL};
+char *CONF_HL_keywords[] = {
+	"true|", "false|", "yes|", "no|", "on|", "off|", "null|", NULL};
+
+struct editorSyntax HLDB[] = {
+	{"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+	 HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+	{"conf", CONF_HL_extensions, CONF_HL_keywords, "#", NULL, NULL,
+	 HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+#pragma endregion
+
+/*** prototypes ***/
+#pragma region
+
+void editorRenderRelease(erow *row);
+void editorUpdateWindowSize();
+void editorLoaderUpdate();
+void editorLoaderStop();
+void editorCacheClose();
+void editorLoaderStart();
+void editorLineStore(int k, size_t off);
+void editorSetStatusMessage(char *fmt, ...);
+void editorRefreshScreen();
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorSearchUpdate();
+void editorSearchContinue();
+void editorFilterAppend(int from);
+void editorFollowNote(struct stat *st, bool partial);
+void editorFollowCheck();
+void editorFollowUpdate();
+void editorStreamUpdate();
+void editorFollowStop();
+size_t editorLineOffset(int k);
+bool abReserve(struct abuf *ab, int len);
+void abAppend(struct abuf *ab, const char *s, int len);
+void abFree(struct abuf *ab);
+void editorProcessKeypress();
+void editorInvalidateScreen();
+void editorTermReply(const char *s, int len);
+#ifdef VEITOR_BENCH
+void benchTermWrite(const char *s, int len);
+bool benchFeed();
+#endif
+#ifdef VEITOR_STATS
+void statsRecord(int stage, struct timespec *start);
+void statsOverlay(struct abuf *line);
+void statsDump();
+#endif
+
+#pragma endregion
+
 /*** terminal ***/
 #pragma region
 
@@ -116,8 +603,9 @@ void enableRawMode()
 	raw.c_oflag &= ~(OPOST);
 	raw.c_cflag |= (CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	// 事件循环用 poll 等待输入，read 只在有数据时调用
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	// 加载终端属性
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
@@ -126,84 +614,236 @@ void enableRawMode()
 	}
 }
 
-int editorReadKey()
+// 查询终端是否支持同步更新，应答在读取按键时处理
+void editorTermQuery()
 {
-	int nread;
-	char c;
-	// 循环直到从终端读取到指令
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-	{
-		if (nread == -1 && errno != EAGAIN)
-			die("read");
-	}
-	if (c == '\x1b')
+	write(STDOUT_FILENO, "\x1b[?2026$p", 10);
+}
+
+// 处理终端应答：DECRQM 的 CSI ? 2026 ; Ps $ y，Ps 为 1 或 2 表示支持
+void editorTermReply(const char *s, int len)
+{
+	static const char prefix[] = "\x1b[?2026;";
+	int plen = sizeof(prefix) - 1;
+	if (len != plen + 3 || memcmp(s, prefix, plen) != 0 || memcmp(s + plen + 1, "$y", 2) != 0)
+		return;
+	E.syncupdate = s[plen] == '1' || s[plen] == '2';
+}
+
+// 从 s 的开头解码一个按键，返回消耗的字节数；序列不完整且 final 为假时返回 0
+int editorDecodeKey(const char *s, int n, bool final, int *key)
+{
+	*key = s[0];
+	if (s[0] != '\x1b')
+		return 1;
+
+	*key = '\x1b';
+	if (n < 3)
+		return final ? n : 0;
+
+	if (s[1] == '[')
 	{
-		char seq[3];
-		if (read(STDIN_FILENO, &seq[0], 1) != 1)
-			return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1)
-			return '\x1b';
-		if (seq[0] == '[')
+		// CSI ? ... 是终端的应答，读到终止字节为止
+		if (s[2] == '?')
 		{
-			if (seq[1] >= '0' && seq[1] <= '9')
-			{
-				if (read(STDIN_FILENO, &seq[2], 1) != 1)
-					return '\x1b';
-				if (seq[2] == '~')
-				{
-					switch (seq[1])
-					{
-					case '1':
-						return HOME_KEY;
-					case '3':
-						return DEL_KEY;
-					case '4':
-						return END_KEY;
-					case '5':
-						return PAGE_UP;
-					case '6':
-						return PAGE_DOWN;
-					case '7':
-						return HOME_KEY;
-					case '8':
-						return END_KEY;
-					}
-				}
-			}
-			else
+			int i = 3;
+			while (i < n && !(s[i] >= 0x40 && s[i] <= 0x7e))
+				i++;
+			*key = TERM_REPLY;
+			if (i == n)
+				return final ? n : 0;
+			editorTermReply(s, i + 1);
+			return i + 1;
+		}
+		if (s[2] >= '0' && s[2] <= '9')
+		{
+			if (n < 4)
+				return final ? n : 0;
+			if (s[3] == '~')
 			{
-				switch (seq[1])
+				switch (s[2])
 				{
-				case 'A':
-					return ARROW_UP;
-				case 'B':
-					return ARROW_DOWN;
-
-				case 'C':
-					return ARROW_RIGHT;
-				case 'D':
-					return ARROW_LEFT;
-				case 'H':
-					return HOME_KEY;
-				case 'F':
-					return END_KEY;
+				case '1':
+				case '7':
+					*key = HOME_KEY;
+					break;
+				case '3':
+					*key = DEL_KEY;
+					break;
+				case '4':
+				case '8':
+					*key = END_KEY;
+					break;
+				case '5':
+					*key = PAGE_UP;
+					break;
+				case '6':
+					*key = PAGE_DOWN;
+					break;
 				}
 			}
+			return 4;
 		}
-		else if (seq[0] == 'O')
+		switch (s[2])
 		{
-			switch (seq[1])
-			{
-			case 'H':
-				return HOME_KEY;
-			case 'F':
-				return END_KEY;
-			}
+		case 'A':
+			*key = ARROW_UP;
+			break;
+		case 'B':
+			*key = ARROW_DOWN;
+			break;
+		case 'C':
+			*key = ARROW_RIGHT;
+			break;
+		case 'D':
+			*key = ARROW_LEFT;
+			break;
+		case 'H':
+			*key = HOME_KEY;
+			break;
+		case 'F':
+			*key = END_KEY;
+			break;
 		}
-		return '\x1b';
 	}
-	else
-		return c;
+	else if (s[1] == 'O')
+	{
+		switch (s[2])
+		{
+		case 'H':
+			*key = HOME_KEY;
+			break;
+		case 'F':
+			*key = END_KEY;
+			break;
+		}
+	}
+	return 3;
+}
+
+// 把输入缓冲区中完整的按键解码到队列，final 为真时不完整的转义序列按 ESC 处理
+void editorDecodeKeys(bool final)
+{
+	int pos = 0;
+	while (pos < E.inlen && E.keyqlen < VEITOR_KEYQ_SIZE)
+	{
+		int key;
+		int used = editorDecodeKey(E.inbuf + pos, E.inlen - pos, final, &key);
+		if (used == 0)
+			break;
+		pos += used;
+		if (key == TERM_REPLY)
+			continue;
+		E.keyq[(E.keyqhead + E.keyqlen) % VEITOR_KEYQ_SIZE] = key;
+		E.keyqlen++;
+	}
+	memmove(E.inbuf, E.inbuf + pos, E.inlen - pos);
+	E.inlen -= pos;
+}
+
+// 一次读取所有已到达的输入，解码后放入按键队列
+void editorFillKeys()
+{
+	int nread = read(STDIN_FILENO, E.inbuf + E.inlen, sizeof(E.inbuf) - E.inlen);
+	if (nread == -1 && errno != EAGAIN && errno != EINTR)
+		die("read");
+	if (nread > 0)
+		E.inlen += nread;
+	editorDecodeKeys(false);
+}
+
+// 距离状态栏消息过期还有多少毫秒，没有需要等待的消息时返回 -1
+int editorStatusTimeout()
+{
+	if (E.statusmsg[0] == '\0')
+		return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long left = (long long)(E.statusmsg_time + 5) * 1000 -
+					 ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	return left > 0 ? (int)left : -1;
+}
+
+// 等待输入、窗口大小变化或状态栏消息过期，空闲时不会被唤醒
+void editorWaitEvents()
+{
+#ifdef VEITOR_BENCH
+	// 基准测试没有终端，提示框等待输入时由脚本送入下一个按键
+	if (benchFeed())
+		return;
+#endif
+	struct pollfd fds[6] = {
+		{STDIN_FILENO, POLLIN, 0},
+		{E.winchpipe[0], POLLIN, 0},
+		{E.loader.notify[0], POLLIN, 0},
+		{E.search.notify[0], POLLIN, 0},
+		{E.follow.inotify, POLLIN, 0},	// 未开启跟随时为 -1，poll 会忽略
+		{E.stream.fd, POLLIN, 0},
+	};
+	int timeout = editorStatusTimeout();
+	// 等待转义序列的后续字节
+	if (E.inlen > 0 && (timeout == -1 || timeout > VEITOR_ESC_TIMEOUT_MS))
+		timeout = VEITOR_ESC_TIMEOUT_MS;
+
+	int n = poll(fds, 6, timeout);
+	if (n == -1)
+	{
+		if (errno == EINTR)
+			return;
+		die("poll");
+	}
+
+	if (fds[1].revents & POLLIN)
+	{
+		char buf[64];
+		while (read(E.winchpipe[0], buf, sizeof(buf)) > 0)
+			;
+		editorUpdateWindowSize();
+	}
+	if (fds[2].revents & POLLIN)
+		editorLoaderUpdate();
+	if (fds[3].revents & POLLIN)
+		editorSearchUpdate();
+	if (fds[4].revents & POLLIN)
+		editorFollowUpdate();
+	if (fds[5].revents & (POLLIN | POLLHUP | POLLERR))
+		editorStreamUpdate();
+	if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+		editorFillKeys();
+	else if (n == 0 && E.inlen > 0)
+		editorDecodeKeys(true);
+}
+
+int editorReadKey()
+{
+	// 循环直到从终端读取到指令
+	while (E.keyqlen == 0)
+		editorWaitEvents();
+
+	int key = E.keyq[E.keyqhead];
+	E.keyqhead = (E.keyqhead + 1) % VEITOR_KEYQ_SIZE;
+	E.keyqlen--;
+	E.stats.keys++;
+	return key;
+}
+
+// 终端是否已有可读的输入
+bool editorInputReady()
+{
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	return poll(&pfd, 1, 0) > 0;
+}
+
+// SIGWINCH 只向管道写入一个字节，由事件循环处理
+void editorHandleSigwinch(int sig)
+{
+	(void)sig;
+	int saved = errno;
+	if (write(E.winchpipe[1], "", 1) == -1)
+	{
+		// 管道已满时说明已有未处理的通知
+	}
+	errno = saved;
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -236,6 +876,12 @@ int getCursorPosition(int *rows, int *cols)
 
 int getWindowSize(int *rows, int *cols)
 {
+#ifdef VEITOR_BENCH
+	// 基准测试没有终端，大小由命令行指定，这里先给默认值
+	*rows = 24;
+	*cols = 80;
+	return 0;
+#endif
 	struct winsize ws;
 	// 是否得到窗口大小
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
@@ -255,209 +901,4355 @@ int getWindowSize(int *rows, int *cols)
 
 #pragma endregion
 
-/*** row operations ***/
+/*** arena ***/
 #pragma region
 
-// 判断字符是否是多字节的一部分 10XXXXXX
-bool is_continuation_byte(char c) {
-    return (c & 0xC0) == 0x80;
-}
-
-// 检查当前字符是否为多字节字符（超过 2 个字节）
-int char_byte(char str) {
-    if ((str & 0xF0) == 0xF0) {  // 检查前 4 位是否为 11110
-        return 4;
-    } else if ((str & 0xE0) == 0xE0) {  // 检查前 3 位是否为 1110
-        return 3;
-    } else if ((str & 0xC0) == 0xC0) {  // 检查前 2 位是否为 110
-        return 2;
-    }
-    return 1;
+// 分配 cap 字节的新块
+arenaBlock *arenaBlockNew(arena *a, size_t cap)
+{
+	arenaBlock *b = malloc(sizeof(arenaBlock) + cap);
+	if (b == NULL)
+		die("malloc");
+	b->used = 0;
+	b->cap = cap;
+	a->total += cap;
+	return b;
 }
 
-// 将tab转换为指定空格长度，实现tab的秘密   ；按照字节大小读取
-int editorRowCxToRx(erow *row, int cx) 
+// 按分配顺序排列的块：当前块放不下时新块总放在链表头部，撤销日志依赖这个顺序截断
+void *arenaAllocOrdered(arena *a, size_t n)
 {
-    int j = 0;
-    int rx = 0;
-	// 使用字符的字节数替换 字节递增
-    while (j < cx) 
+	arenaBlock *b = a->head;
+	if (b == NULL || b->cap - b->used < n)
 	{
-		int bytesize = char_byte(row->chars[j]);
-        if (row->chars[j] == '\t') 
-		{
-            rx += (VEITOR_TAP_STOP - 1) - (rx % VEITOR_TAP_STOP);
-        }
-		else if (bytesize > 2)
-			rx++;
-        rx++;
-        j += bytesize;
+		b = arenaBlockNew(a, n > VEITOR_ARENA_BLOCK ? n : VEITOR_ARENA_BLOCK);
+		b->next = a->head;
+		a->head = b;
 	}
-    return rx;
+	void *p = b->data + b->used;
+	b->used += n;
+	return p;
 }
 
-void editorUpdateRow(struct erow *row)
+void *arenaAlloc(arena *a, size_t n)
 {
-	int j = 0;
-	int tab = 0;
-	// 使用字符的字节数替换 字节递增
-	while (j < row->size)
+	arenaBlock *b = a->head;
+	// 超过块大小的请求单独成块，接在当前块之后，当前块剩余的空间继续留给小的分配
+	if (n > VEITOR_ARENA_BLOCK && b != NULL && b->cap - b->used < n)
 	{
-		int bytesize = char_byte(row->chars[j]);
-		if (row->chars[j] == '\t')
-			tab++;
-		
-		j += bytesize;
+		arenaBlock *big = arenaBlockNew(a, n);
+		big->next = b->next;
+		b->next = big;
+		big->used = n;
+		return big->data;
 	}
-
-	free(row->render);
-	row->render = malloc(row->size + tab * (VEITOR_TAP_STOP - 1) + 1);
-
-	int index = 0;
-	j = 0;
-	// 使用字符的字节数替换 字节递增
-	while (j < row->size) 
-	{
-        int bytesize = char_byte(row->chars[j]);
-        if (row->chars[j] == '\t') 
-		{
-            row->render[index++] = ' ';
-            while (index % VEITOR_TAP_STOP != 0) 
-                row->render[index++] = ' ';
-        } 
-		else 
-		{
-            memcpy(&row->render[index], &row->chars[j], bytesize);
-            index += bytesize;
-        }
-        j += bytesize;
-    }
-	row->render[index] = '\0';
-	row->rsize = index;
-}
-
-// 读取文件内容
-void editorAppendRow(char *s, size_t len)
-{
-	// realloc可以调整分配内存大小，如果小了会截断
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-
-	int at = E.numrows;
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
-
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	editorUpdateRow((&E.row[at]));
-
-	E.numrows++;
+	return arenaAllocOrdered(a, n);
 }
 
-#pragma endregion
-
-/*** file i/o ***/
-#pragma region
-
-// 打开文件，读取
-void editorOpen(char *filename)
+void arenaFree(arena *a)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
-
-	FILE *fp = fopen(filename, "r");
-	if (!fp)
-		die("fopen");
-
-	char *line = NULL;
-	ssize_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	arenaBlock *b = a->head;
+	while (b)
 	{
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-							   line[linelen - 1] == '\r'))
-			linelen--;
-		editorAppendRow(line, linelen);
+		arenaBlock *next = b->next;
+		free(b);
+		b = next;
 	}
-
-	free(line);
-	fclose(fp);
+	a->head = NULL;
+	a->total = 0;
 }
 
 #pragma endregion
 
-/*** appenf buffer ***/
+/*** unicode ***/
 #pragma region
 
-// 存储文本内容的结构体
-struct abuf
-{
-	char *b;
-	int len;
-};
-
-#define ABUF_INIT {NULL, 0}
-
-// 向结构体中添加一行文本
-void abAppend(struct abuf *ab, const char *s, int len)
-{
-	char *new = realloc(ab->b, ab->len + len);
-
-	if (new == NULL)
-		return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
-}
-
-void abFree(struct abuf *ab)
+// 码点的显示宽度：0、1 或 2 列
+static inline int unicodeWidth(uint32_t cp)
 {
-	free(ab->b);
+	if (cp >= 0x110000)
+		return 1;
+	unsigned int i = cp % VEITOR_WIDTH_BLOCK;
+	return (widthStage2[widthStage1[cp / VEITOR_WIDTH_BLOCK]][i >> 2] >> ((i & 3) * 2)) & 3;
 }
 
-#pragma endregion
-
-/*** output ***/
-#pragma region
-
-void editorScroll()
+// 解码 s 开头的一个 UTF-8 字符，最多读取 n 个字节，返回字节数；
+// 不合法的序列只消耗一个字节，码点为 U+FFFD
+int utf8Decode(const char *s, int n, uint32_t *cp)
 {
-	E.rx = E.cx;
-	if (E.cy < E.numrows)
+	const unsigned char *u = (const unsigned char *)s;
+	unsigned char c = u[0];
+	int len;
+	uint32_t v, min;
+	if (c < 0x80)
 	{
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		*cp = c;
+		return 1;
 	}
-
-	// 当文本纵坐标小于行偏移量时
-	if (E.cy < E.rowoff)
+	else if (c >= 0xC2 && c < 0xE0)
 	{
-		E.rowoff = E.cy;
+		len = 2;
+		v = c & 0x1F;
+		min = 0x80;
 	}
-	// 当文本纵坐标大于行偏移量+终端行数时
-	if (E.cy >= E.rowoff + E.screenrows)
+	else if (c >= 0xE0 && c < 0xF0)
 	{
-		E.rowoff = E.cy - E.screenrows + 1;
+		len = 3;
+		v = c & 0x0F;
+		min = 0x800;
 	}
-
-	if (E.rx < E.coloff)
+	else if (c >= 0xF0 && c < 0xF5)
 	{
-		E.coloff = E.rx;
+		len = 4;
+		v = c & 0x07;
+		min = 0x10000;
 	}
-	if (E.rx >= E.coloff + E.screencols)
+	else
 	{
-		E.coloff = E.rx - E.screencols + 1;
+		*cp = 0xFFFD;
+		return 1;
 	}
-}
 
-void editorDrawRows(struct abuf *ab)
-{
-	int y;
-	for (y = 0; y < E.screenrows; y++)
+	if (n < len)
 	{
-		int filerow = y + E.rowoff;
-		// 如果行偏移量大于文件内容行数，则不会显示默认文本
-		if (filerow >= E.numrows)
+		*cp = 0xFFFD;
+		return 1;
+	}
+	for (int i = 1; i < len; i++)
+	{
+		if ((u[i] & 0xC0) != 0x80)
+		{
+			*cp = 0xFFFD;
+			return 1;
+		}
+		v = (v << 6) | (u[i] & 0x3F);
+	}
+	// 过长编码和代理区码点不合法
+	if (v < min || v > 0x10FFFF || (v >= 0xD800 && v <= 0xDFFF))
+	{
+		*cp = 0xFFFD;
+		return 1;
+	}
+	*cp = v;
+	return len;
+}
+
+// s 处字符的显示列数，*len 为字节数；单独出现的后续字节不占列，
+// 以便从多字节字符中间开始计数（列索引的检查点）
+int utf8Width(const char *s, int n, int *len)
+{
+	unsigned char c = s[0];
+	if (c < 0x80)
+	{
+		*len = 1;
+		return 1;
+	}
+	if ((c & 0xC0) == 0x80)
+	{
+		*len = 1;
+		return 0;
+	}
+	uint32_t cp;
+	*len = utf8Decode(s, n, &cp);
+	return unicodeWidth(cp);
+}
+
+// 从 s 开头跳过总宽度不超过 cols 列的字符，返回字节数，*used 为跳过的列数；
+// 紧跟在后面的零宽字符一起跳过。s 中不含 tab
+int widthSkip(const char *s, int n, int cols, int *used)
+{
+	int i = 0, w = 0;
+	while (i < n)
+	{
+		// 整段 ASCII 一次跳过 8 字节
+		if (i + 8 <= n && w + 8 <= cols)
+		{
+			uint64_t v;
+			memcpy(&v, s + i, 8);
+			if ((v & 0x8080808080808080ULL) == 0)
+			{
+				i += 8;
+				w += 8;
+				continue;
+			}
+		}
+		int len;
+		int cw = utf8Width(s + i, n - i, &len);
+		if (w + cw > cols)
+			break;
+		w += cw;
+		i += len;
+	}
+	*used = w;
+	return i;
+}
+
+#pragma endregion
+
+/*** simd ***/
+#pragma region
+
+// 计算 s 的前 n 个字节的显示列数：tab 对齐到制表位，其余按码点查宽度表；
+// 字符的宽度计在首字节上，解码时最多读到 s + limit
+int scanColumnsScalar(const char *s, int n, int limit, int rx)
+{
+	int i = 0;
+	while (i < n)
+	{
+		unsigned char c = s[i];
+		if (c == '\t')
+		{
+			rx += VEITOR_TAP_STOP - (rx % VEITOR_TAP_STOP);
+			i++;
+		}
+		else if (c < 0x80)
+		{
+			rx++;
+			i++;
+		}
+		else
+		{
+			int len;
+			rx += utf8Width(s + i, limit - i, &len);
+			i += len;
+		}
+	}
+	return rx;
+}
+
+// 返回 ROW_ASCII 和 ROW_TAB 标记
+int scanClassifyScalar(const char *s, int n)
+{
+	unsigned char high = 0;
+	bool tab = false;
+	for (int i = 0; i < n; i++)
+	{
+		high |= s[i];
+		tab |= s[i] == '\t';
+	}
+	return (high & 0x80 ? 0 : ROW_ASCII) | (tab ? ROW_TAB : 0);
+}
+
+int scanCountTabsScalar(const char *s, int n)
+{
+	int tab = 0;
+	for (int i = 0; i < n; i++)
+		tab += s[i] == '\t';
+	return tab;
+}
+
+// 在 s 中查找第一次出现的 p
+const char *scanFindScalar(const char *s, size_t n, const char *p, size_t m)
+{
+	return memmem(s, n, p, m);
+}
+
+#ifdef VEITOR_X86
+// 一次分类 16 字节：纯 ASCII 直接计数，只有 tab 时第一个 tab 之前的字节一起计数，
+// 含多字节字符的块逐个码点查表
+int scanColumnsSSE2(const char *s, int n, int limit, int rx)
+{
+	const __m128i tab = _mm_set1_epi8('\t');
+	int i = 0;
+	while (i + 16 <= n)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned int tabs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+		unsigned int high = _mm_movemask_epi8(v);
+		if ((tabs | high) == 0)
+		{
+			rx += 16;
+			i += 16;
+			continue;
+		}
+		if (high)
+		{
+			// 跨块的字符计在首字节所在的块，下一块开头的后续字节不占列
+			rx = scanColumnsScalar(s + i, 16, limit - i, rx);
+			i += 16;
+			continue;
+		}
+		int len = __builtin_ctz(tabs);
+		rx += len;
+		i += len;
+		rx += VEITOR_TAP_STOP - (rx % VEITOR_TAP_STOP);
+		i++;
+	}
+	return scanColumnsScalar(s + i, n - i, limit - i, rx);
+}
+
+int scanClassifySSE2(const char *s, int n)
+{
+	const __m128i tab = _mm_set1_epi8('\t');
+	__m128i high = _mm_setzero_si128(), tabs = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		high = _mm_or_si128(high, v);
+		tabs = _mm_or_si128(tabs, _mm_cmpeq_epi8(v, tab));
+	}
+	int flags = scanClassifyScalar(s + i, n - i);
+	if (_mm_movemask_epi8(high))
+		flags &= ~ROW_ASCII;
+	if (_mm_movemask_epi8(tabs))
+		flags |= ROW_TAB;
+	return flags;
+}
+
+int scanCountTabsSSE2(const char *s, int n)
+{
+	const __m128i tab = _mm_set1_epi8('\t');
+	int count = 0;
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+	}
+	return count + scanCountTabsScalar(s + i, n - i);
+}
+
+// 同时比较候选位置的首字节和尾字节，两者都相同时才比较中间部分
+const char *scanFindSSE2(const char *s, size_t n, const char *p, size_t m)
+{
+	if (m < 2 || n < m)
+		return scanFindScalar(s, n, p, m);
+
+	const __m128i first = _mm_set1_epi8(p[0]);
+	const __m128i last = _mm_set1_epi8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+															 _mm_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+				return s + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return scanFindScalar(s + i, n - i, p, m);
+}
+
+__attribute__((target("avx2,popcnt")))
+int scanColumnsAVX2(const char *s, int n, int limit, int rx)
+{
+	const __m256i tab = _mm256_set1_epi8('\t');
+	int i = 0;
+	while (i + 32 <= n)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		unsigned int tabs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+		unsigned int high = _mm256_movemask_epi8(v);
+		if ((tabs | high) == 0)
+		{
+			rx += 32;
+			i += 32;
+			continue;
+		}
+		if (high)
+		{
+			rx = scanColumnsScalar(s + i, 32, limit - i, rx);
+			i += 32;
+			continue;
+		}
+		int len = __builtin_ctz(tabs);
+		rx += len;
+		i += len;
+		rx += VEITOR_TAP_STOP - (rx % VEITOR_TAP_STOP);
+		i++;
+	}
+	return scanColumnsSSE2(s + i, n - i, limit - i, rx);
+}
+
+__attribute__((target("avx2,popcnt")))
+int scanClassifyAVX2(const char *s, int n)
+{
+	const __m256i tab = _mm256_set1_epi8('\t');
+	__m256i high = _mm256_setzero_si256(), tabs = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		high = _mm256_or_si256(high, v);
+		tabs = _mm256_or_si256(tabs, _mm256_cmpeq_epi8(v, tab));
+	}
+	int flags = scanClassifySSE2(s + i, n - i);
+	if (_mm256_movemask_epi8(high))
+		flags &= ~ROW_ASCII;
+	if (_mm256_movemask_epi8(tabs))
+		flags |= ROW_TAB;
+	return flags;
+}
+
+__attribute__((target("avx2,popcnt")))
+int scanCountTabsAVX2(const char *s, int n)
+{
+	const __m256i tab = _mm256_set1_epi8('\t');
+	int count = 0;
+	int i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab)));
+	}
+	return count + scanCountTabsSSE2(s + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+const char *scanFindAVX2(const char *s, size_t n, const char *p, size_t m)
+{
+	if (m < 2 || n < m)
+		return scanFindScalar(s, n, p, m);
+
+	const __m256i first = _mm256_set1_epi8(p[0]);
+	const __m256i last = _mm256_set1_epi8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+																   _mm256_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+				return s + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return scanFindSSE2(s + i, n - i, p, m);
+}
+#endif
+
+// 按 CPU 支持的指令集选择的实现
+int (*scanColumns)(const char *s, int n, int limit, int rx) = scanColumnsScalar;
+int (*scanCountTabs)(const char *s, int n) = scanCountTabsScalar;
+int (*scanClassify)(const char *s, int n) = scanClassifyScalar;
+const char *(*scanFind)(const char *s, size_t n, const char *p, size_t m) = scanFindScalar;
+
+void scanInit()
+{
+#ifdef VEITOR_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		scanColumns = scanColumnsAVX2;
+		scanCountTabs = scanCountTabsAVX2;
+		scanClassify = scanClassifyAVX2;
+		scanFind = scanFindAVX2;
+	}
+	else
+	{
+		scanColumns = scanColumnsSSE2;
+		scanCountTabs = scanCountTabsSSE2;
+		scanClassify = scanClassifySSE2;
+		scanFind = scanFindSSE2;
+	}
+#endif
+}
+
+#pragma endregion
+
+/*** worker pool ***/
+#pragma region
+
+void *poolWorker(void *arg)
+{
+	workerPool *p = arg;
+	pthread_mutex_lock(&p->lock);
+	while (1)
+	{
+		while (p->next >= p->ntasks)
+			pthread_cond_wait(&p->work, &p->lock);
+		int task = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		p->fn(p->arg, task);
+
+		pthread_mutex_lock(&p->lock);
+		if (++p->finished == p->ntasks)
+			pthread_cond_signal(&p->done);
+	}
+	return NULL;
+}
+
+// 默认使用全部在线的 CPU，VEITOR_THREADS 环境变量可以指定线程数
+void poolInit(workerPool *p)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	char *env = getenv("VEITOR_THREADS");
+	if (env && atoi(env) > 0)
+		n = atoi(env);
+	if (n < 1)
+		n = 1;
+
+	p->nthreads = n - 1;
+	p->ntasks = p->next = p->finished = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_mutex_init(&p->runlock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->threads = malloc(sizeof(pthread_t) * (p->nthreads + 1));
+	if (p->threads == NULL)
+		die("malloc");
+	for (int i = 0; i < p->nthreads; i++)
+	{
+		if (pthread_create(&p->threads[i], NULL, poolWorker, p) != 0)
+			die("pthread_create");
+	}
+}
+
+// 执行 fn(arg, 0..ntasks-1)，全部完成后返回
+void poolRun(workerPool *p, void (*fn)(void *arg, int task), void *arg, int ntasks)
+{
+	pthread_mutex_lock(&p->runlock);
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->finished = 0;
+	p->next = 0;
+	p->ntasks = ntasks;
+	pthread_cond_broadcast(&p->work);
+
+	while (p->next < p->ntasks)
+	{
+		int task = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		fn(arg, task);
+		pthread_mutex_lock(&p->lock);
+		p->finished++;
+	}
+	while (p->finished < p->ntasks)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	pthread_mutex_unlock(&p->runlock);
+}
+
+#pragma endregion
+
+/*** line index ***/
+#pragma region
+
+// 一个扫描任务找到的换行位置
+typedef struct indexChunk
+{
+	const char *buf;
+	size_t from, to;
+	size_t *off;
+	int n, cap;
+} indexChunk;
+
+void indexChunkScan(void *arg, int task)
+{
+	indexChunk *c = &((indexChunk *)arg)[task];
+	size_t pos = c->from;
+	while (pos < c->to)
+	{
+		const char *nl = memchr(c->buf + pos, '\n', c->to - pos);
+		if (nl == NULL)
+			break;
+		pos = nl - c->buf + 1;
+		if (c->n == c->cap)
+		{
+			c->cap = c->cap ? c->cap * 2 : 4096;
+			c->off = realloc(c->off, sizeof(size_t) * c->cap);
+			if (c->off == NULL)
+				die("realloc");
+		}
+		c->off[c->n++] = pos;
+	}
+}
+
+// 扫描 buf[from, to) 中的换行符，把每行的结束位置追加到 off[*n] 之后；
+// off[*n] 始终是下一行的起始偏移 from，at_end 为真时末尾没有换行的部分也算一行
+void lineIndexScan(const char *buf, size_t from, size_t to, bool at_end,
+				   size_t **off, int *n, int *cap)
+{
+	// 按 CPU 数切分，每块不小于 VEITOR_INDEX_CHUNK
+	int ntasks = (E.pool.nthreads + 1) * 4;
+	if ((size_t)ntasks > (to - from) / VEITOR_INDEX_CHUNK)
+		ntasks = (to - from) / VEITOR_INDEX_CHUNK;
+	if (ntasks < 1)
+		ntasks = 1;
+
+	indexChunk *chunks = calloc(ntasks, sizeof(indexChunk));
+	if (chunks == NULL)
+		die("calloc");
+	size_t step = (to - from) / ntasks;
+	for (int i = 0; i < ntasks; i++)
+	{
+		chunks[i].buf = buf;
+		chunks[i].from = from + step * i;
+		chunks[i].to = i == ntasks - 1 ? to : from + step * (i + 1);
+	}
+	if (ntasks == 1)
+		indexChunkScan(chunks, 0);
+	else
+		poolRun(&E.pool, indexChunkScan, chunks, ntasks);
+
+	// 按顺序合并到全局索引
+	int total = 0;
+	for (int i = 0; i < ntasks; i++)
+		total += chunks[i].n;
+	int need = *n + total + 2;
+	if (need > *cap)
+	{
+		int newcap = *cap ? *cap : 1024;
+		while (newcap < need)
+			newcap *= 2;
+		*off = realloc(*off, sizeof(size_t) * newcap);
+		if (*off == NULL)
+			die("realloc");
+		*cap = newcap;
+	}
+	(*off)[*n] = from;
+	for (int i = 0; i < ntasks; i++)
+	{
+		// 没有找到换行的任务没有分配 off
+		if (chunks[i].n > 0)
+			memcpy(&(*off)[*n + 1], chunks[i].off, sizeof(size_t) * chunks[i].n);
+		*n += chunks[i].n;
+		free(chunks[i].off);
+	}
+	free(chunks);
+
+	if (at_end && (*off)[*n] < to)
+		(*off)[++*n] = to;
+}
+
+#pragma endregion
+
+/*** piece table ***/
+#pragma region
+
+// 原始文本在第一次编辑时冻结：视图模式下就是映射的文件，
+// 普通模式下是各行依次拼接、每行末尾补一个换行，行起始偏移都记录在 lineblk 中
+
+// 原始文本中位于 x 之前的换行数
+int editorLineSearch(size_t x, int hi);
+
+int ptOrigNlBefore(size_t x)
+{
+	return editorLineSearch(x, E.pt.orignl);
+}
+
+// 行索引 [0, hi] 中起始偏移不超过 x 的最后一行
+int editorLineSearch(size_t x, int hi)
+{
+	int lo = 0;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo + 1) / 2;
+		if (editorLineOffset(mid) <= x)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+// 复制原始文本 [a, a + n)
+void ptOrigCopy(size_t a, size_t n, char *dst)
+{
+	if (E.viewmode)
+	{
+		memcpy(dst, E.map + a, n);
+		return;
+	}
+
+	int line = ptOrigNlBefore(a);
+	size_t col = a - editorLineOffset(line);
+	while (n > 0)
+	{
+		erow *row = &E.row[line];
+		size_t run = col < (size_t)row->size ? row->size - col : 0;
+		if (run > n)
+			run = n;
+		memcpy(dst, row->chars + col, run);
+		dst += run;
+		n -= run;
+		if (n > 0)
+		{
+			*dst++ = '\n';
+			n--;
+		}
+		line++;
+		col = 0;
+	}
+}
+
+// 追加缓冲区中位于 x 之前的换行数
+int ptAddNlBefore(size_t x)
+{
+	int lo = 0, hi = E.pt.addnlcount;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (E.pt.addnl[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// 统计片段所在文本 [from, to) 中的换行数
+int ptCountNl(bool add, size_t from, size_t to)
+{
+	if (!add)
+		return ptOrigNlBefore(to) - ptOrigNlBefore(from);
+
+	return ptAddNlBefore(to) - ptAddNlBefore(from);
+}
+
+// 片段内第 k 个换行（从 1 开始）相对片段开头的位置
+size_t ptPieceNewline(piece *p, int k)
+{
+	if (!p->add)
+		return editorLineOffset(ptOrigNlBefore(p->start) + k) - 1 - p->start;
+
+	return E.pt.addnl[ptAddNlBefore(p->start) + k - 1] - p->start;
+}
+
+void ptPull(int t)
+{
+	piece *p = &E.pt.node[t];
+	p->bytes = p->len;
+	p->nls = p->nl;
+	if (p->left != -1)
+	{
+		p->bytes += E.pt.node[p->left].bytes;
+		p->nls += E.pt.node[p->left].nls;
+	}
+	if (p->right != -1)
+	{
+		p->bytes += E.pt.node[p->right].bytes;
+		p->nls += E.pt.node[p->right].nls;
+	}
+}
+
+int ptNewNode(bool add, size_t start, size_t len, int nl, unsigned int prio)
+{
+	if (E.pt.free == -1)
+	{
+		int cap = E.pt.cap ? E.pt.cap * 2 : 256;
+		piece *new = realloc(E.pt.node, sizeof(piece) * cap);
+		if (new == NULL)
+			die("realloc");
+		E.pt.node = new;
+		for (int j = E.pt.cap; j < cap; j++)
+			E.pt.node[j].left = j + 1 < cap ? j + 1 : -1;
+		E.pt.free = E.pt.cap;
+		E.pt.cap = cap;
+	}
+	int t = E.pt.free;
+	piece *p = &E.pt.node[t];
+	E.pt.free = p->left;
+	E.pt.used++;
+
+	p->add = add;
+	p->start = start;
+	p->len = len;
+	p->nl = nl;
+	p->left = p->right = -1;
+	p->prio = prio;
+	ptPull(t);
+	return t;
+}
+
+void ptFreeTree(int t)
+{
+	if (t == -1)
+		return;
+	ptFreeTree(E.pt.node[t].left);
+	ptFreeTree(E.pt.node[t].right);
+	E.pt.node[t].left = E.pt.free;
+	E.pt.free = t;
+	E.pt.used--;
+}
+
+// 按字节偏移拆成 [0, off) 和 [off, ...) 两棵树，必要时把片段切开
+void ptSplit(int t, size_t off, int *l, int *r)
+{
+	if (t == -1)
+	{
+		*l = *r = -1;
+		return;
+	}
+
+	piece *p = &E.pt.node[t];
+	size_t lb = p->left != -1 ? E.pt.node[p->left].bytes : 0;
+	// 递归中可能分配新节点，不能持有节点的地址
+	if (off <= lb)
+	{
+		int left;
+		ptSplit(p->left, off, l, &left);
+		E.pt.node[t].left = left;
+		ptPull(t);
+		*r = t;
+	}
+	else if (off >= lb + p->len)
+	{
+		int right;
+		ptSplit(p->right, off - lb - p->len, &right, r);
+		E.pt.node[t].right = right;
+		ptPull(t);
+		*l = t;
+	}
+	else
+	{
+		// 切开的后半段继承优先级，作为右边子树的根仍满足堆序
+		size_t k = off - lb;
+		int nl = ptCountNl(p->add, p->start, p->start + k);
+		int n = ptNewNode(p->add, p->start + k, p->len - k, p->nl - nl, p->prio);
+		p = &E.pt.node[t];
+		E.pt.node[n].right = p->right;
+		p->right = -1;
+		p->len = k;
+		p->nl = nl;
+		ptPull(n);
+		ptPull(t);
+		*l = t;
+		*r = n;
+	}
+}
+
+int ptMerge(int a, int b)
+{
+	if (a == -1)
+		return b;
+	if (b == -1)
+		return a;
+	if (E.pt.node[a].prio >= E.pt.node[b].prio)
+	{
+		int right = ptMerge(E.pt.node[a].right, b);
+		E.pt.node[a].right = right;
+		ptPull(a);
+		return a;
+	}
+	int left = ptMerge(a, E.pt.node[b].left);
+	E.pt.node[b].left = left;
+	ptPull(b);
+	return b;
+}
+
+size_t ptTotal()
+{
+	return E.pt.root != -1 ? E.pt.node[E.pt.root].bytes : 0;
+}
+
+int ptLines()
+{
+	return E.pt.root != -1 ? E.pt.node[E.pt.root].nls : 0;
+}
+
+// 第 k 行的起始偏移，k 等于行数时返回文档末尾
+size_t ptLineStart(int k)
+{
+	if (k == 0)
+		return 0;
+
+	size_t base = 0;
+	int t = E.pt.root;
+	while (t != -1)
+	{
+		piece *p = &E.pt.node[t];
+		if (p->left != -1)
+		{
+			piece *l = &E.pt.node[p->left];
+			if (l->nls >= k)
+			{
+				t = p->left;
+				continue;
+			}
+			k -= l->nls;
+			base += l->bytes;
+		}
+		if (p->nl >= k)
+			return base + ptPieceNewline(p, k) + 1;
+		k -= p->nl;
+		base += p->len;
+		t = p->right;
+	}
+	return base;
+}
+
+// 复制文档 [off, off + len) 到 dst
+void ptCopy(int t, size_t off, size_t len, char *dst)
+{
+	while (t != -1 && len > 0)
+	{
+		piece *p = &E.pt.node[t];
+		size_t lb = p->left != -1 ? E.pt.node[p->left].bytes : 0;
+		if (off < lb)
+		{
+			size_t n = lb - off < len ? lb - off : len;
+			ptCopy(p->left, off, n, dst);
+			dst += n;
+			off += n;
+			len -= n;
+		}
+		if (len > 0 && off < lb + p->len)
+		{
+			size_t k = off - lb;
+			size_t n = p->len - k < len ? p->len - k : len;
+			if (p->add)
+				memcpy(dst, E.pt.add.b + p->start + k, n);
+			else
+				ptOrigCopy(p->start + k, n, dst);
+			dst += n;
+			off += n;
+			len -= n;
+		}
+		off -= lb + p->len;
+		t = p->right;
+	}
+}
+
+// [off, off + len) 落在视图模式的同一个原始片段内时直接返回映射中的地址
+char *ptSpan(size_t off, size_t len)
+{
+	if (!E.viewmode)
+		return NULL;
+
+	int t = E.pt.root;
+	while (t != -1)
+	{
+		piece *p = &E.pt.node[t];
+		size_t lb = p->left != -1 ? E.pt.node[p->left].bytes : 0;
+		if (off < lb)
+		{
+			t = p->left;
+			continue;
+		}
+		off -= lb;
+		if (off < p->len)
+			return !p->add && off + len <= p->len ? E.map + p->start + off : NULL;
+		off -= p->len;
+		t = p->right;
+	}
+	return NULL;
+}
+
+// 新内容紧接在最后一个片段之后时直接延长该片段，连续输入不会产生新片段
+bool ptExtend(int t, size_t at, size_t len, int nl)
+{
+	if (t == -1)
+		return false;
+
+	piece *p = &E.pt.node[t];
+	bool ok;
+	if (p->right != -1)
+		ok = ptExtend(p->right, at, len, nl);
+	else if ((ok = p->add && p->start + p->len == at))
+	{
+		p->len += len;
+		p->nl += nl;
+	}
+	if (ok)
+		ptPull(t);
+	return ok;
+}
+
+// 在文档偏移 off 处插入 s
+void ptInsert(size_t off, const char *s, int len)
+{
+	size_t at = E.pt.add.len;
+	if (!abReserve(&E.pt.add, len))
+		die("realloc");
+	abAppend(&E.pt.add, s, len);
+	int nl = 0;
+	for (const char *q = s; (q = memchr(q, '\n', s + len - q)) != NULL; q++)
+	{
+		if (E.pt.addnlcount == E.pt.addnlcap)
+		{
+			E.pt.addnlcap = E.pt.addnlcap ? E.pt.addnlcap * 2 : 1024;
+			E.pt.addnl = realloc(E.pt.addnl, sizeof(size_t) * E.pt.addnlcap);
+			if (E.pt.addnl == NULL)
+				die("realloc");
+		}
+		E.pt.addnl[E.pt.addnlcount++] = at + (q - s);
+		nl++;
+	}
+
+	int l, r;
+	ptSplit(E.pt.root, off, &l, &r);
+	if (!ptExtend(l, at, len, nl))
+		l = ptMerge(l, ptNewNode(true, at, len, nl, rand()));
+	E.pt.root = ptMerge(l, r);
+}
+
+// 在文档偏移 off 处依次放入若干已有的文本片段
+void ptInsertSpans(size_t off, undoSpan *spans, int n, bool reverse)
+{
+	int l, r;
+	ptSplit(E.pt.root, off, &l, &r);
+	for (int i = 0; i < n; i++)
+	{
+		undoSpan *sp = &spans[reverse ? n - 1 - i : i];
+		l = ptMerge(l, ptNewNode(sp->add, sp->start, sp->len, sp->nl, rand()));
+	}
+	E.pt.root = ptMerge(l, r);
+}
+
+// 从文档中取下 [off, off + len)，返回取下的子树
+int ptRemove(size_t off, size_t len)
+{
+	int l, m, r;
+	ptSplit(E.pt.root, off, &l, &r);
+	ptSplit(r, len, &m, &r);
+	E.pt.root = ptMerge(l, r);
+	return m;
+}
+
+// 删除文档 [off, off + len)
+void ptDelete(size_t off, size_t len)
+{
+	ptFreeTree(ptRemove(off, len));
+}
+
+// 文档偏移 off 所在的行
+int ptLineAt(size_t off)
+{
+	int nl = 0;
+	int t = E.pt.root;
+	while (t != -1)
+	{
+		piece *p = &E.pt.node[t];
+		size_t lb = p->left != -1 ? E.pt.node[p->left].bytes : 0;
+		if (off < lb)
+		{
+			t = p->left;
+			continue;
+		}
+		if (p->left != -1)
+			nl += E.pt.node[p->left].nls;
+		off -= lb;
+		if (off < p->len)
+			return nl + ptCountNl(p->add, p->start, p->start + off);
+		nl += p->nl;
+		off -= p->len;
+		t = p->right;
+	}
+	return nl;
+}
+
+void ptFree()
+{
+	free(E.pt.node);
+	abFree(&E.pt.add);
+	free(E.pt.addnl);
+	E.pt.addnl = NULL;
+	E.pt.addnlcount = E.pt.addnlcap = 0;
+	E.pt.node = NULL;
+	E.pt.cap = E.pt.used = 0;
+	E.pt.free = E.pt.root = -1;
+	E.pt.orignl = 0;
+	E.pt.active = false;
+}
+
+#pragma endregion
+
+/*** undo ***/
+#pragma region
+
+size_t undoRecordSize(int nspans)
+{
+	return sizeof(undoRecord) + sizeof(undoSpan) * nspans;
+}
+
+// 丢弃 top 之后可重做的记录，它们总在日志末尾
+void undoTruncate()
+{
+	undoLog *u = &E.undo;
+	if (u->top == NULL)
+	{
+		arenaFree(&u->mem);
+		u->first = u->last = NULL;
+		return;
+	}
+
+	arenaBlock *keep = u->top->block;
+	while (u->mem.head != keep)
+	{
+		arenaBlock *b = u->mem.head;
+		u->mem.head = b->next;
+		u->mem.total -= b->cap;
+		free(b);
+	}
+	keep->used = (char *)u->top + undoRecordSize(u->top->nspans) - keep->data;
+	u->top->next = NULL;
+	u->last = u->top;
+}
+
+// 超过上限时从最旧的块开始丢弃，当前记录所在的块保留
+void undoTrim()
+{
+	undoLog *u = &E.undo;
+	while (u->mem.total > u->cap)
+	{
+		arenaBlock *newer = NULL;
+		arenaBlock *b = u->mem.head;
+		while (b->next)
+		{
+			newer = b;
+			b = b->next;
+		}
+		if (newer == NULL || b == u->top->block)
+			break;
+
+		newer->next = NULL;
+		u->mem.total -= b->cap;
+		free(b);
+		u->first = (undoRecord *)newer->data;
+		u->first->prev = NULL;
+	}
+}
+
+// 记录是分配器中的最后一项并且块内还有空间时原地追加片段
+bool undoGrow(undoRecord *rec, int n)
+{
+	arenaBlock *b = rec->block;
+	if ((char *)rec + undoRecordSize(rec->nspans) != b->data + b->used ||
+		b->cap - b->used < sizeof(undoSpan) * n)
+		return false;
+	b->used += sizeof(undoSpan) * n;
+	return true;
+}
+
+undoRecord *undoAppend(bool insert, size_t off, size_t len, int nspans)
+{
+	undoLog *u = &E.undo;
+	undoTruncate();
+	undoRecord *rec = arenaAllocOrdered(&u->mem, undoRecordSize(nspans));
+	rec->block = u->mem.head;
+	rec->insert = insert;
+	rec->back = false;
+	rec->off = off;
+	rec->len = len;
+	rec->nspans = 0;
+	rec->prev = u->last;
+	rec->next = NULL;
+	if (u->last)
+		u->last->next = rec;
+	else
+		u->first = rec;
+	u->last = u->top = rec;
+	undoTrim();
+	return rec;
+}
+
+// 片段与上一个片段在同一文本中首尾相接时合并
+void undoPushSpan(undoRecord *rec, undoSpan sp, bool back)
+{
+	if (rec->nspans > 0)
+	{
+		undoSpan *last = &rec->spans[rec->nspans - 1];
+		if (last->add == sp.add && !back && last->start + last->len == sp.start)
+		{
+			last->len += sp.len;
+			last->nl += sp.nl;
+			return;
+		}
+		if (last->add == sp.add && back && sp.start + sp.len == last->start)
+		{
+			last->start = sp.start;
+			last->len += sp.len;
+			last->nl += sp.nl;
+			return;
+		}
+	}
+	rec->spans[rec->nspans++] = sp;
+}
+
+// 插入的内容位于追加缓冲区的 [at, at + len)
+void undoRecordInsert(size_t off, size_t at, size_t len)
+{
+	undoLog *u = &E.undo;
+	undoSpan sp = {true, at, len, ptCountNl(true, at, at + len)};
+	undoRecord *top = u->top;
+	if (!u->sealed && top && top == u->last && top->insert &&
+		off == top->off + top->len &&
+		(top->spans[top->nspans - 1].start + top->spans[top->nspans - 1].len == at ||
+		 undoGrow(top, 1)))
+	{
+		undoPushSpan(top, sp, false);
+		top->len += len;
+	}
+	else
+	{
+		undoRecord *rec = undoAppend(true, off, len, 1);
+		undoPushSpan(rec, sp, false);
+	}
+	u->sealed = false;
+}
+
+int undoCountPieces(int t)
+{
+	if (t == -1)
+		return 0;
+	return 1 + undoCountPieces(E.pt.node[t].left) + undoCountPieces(E.pt.node[t].right);
+}
+
+// 合并后多预留的片段空间还给所在的块，记录仍是块中最后一项
+void undoFit(undoRecord *rec)
+{
+	rec->block->used = (char *)rec + undoRecordSize(rec->nspans) - rec->block->data;
+}
+
+void undoCollect(undoRecord *rec, int t, bool back)
+{
+	if (t == -1)
+		return;
+	piece *p = &E.pt.node[t];
+	int right = p->right;
+	// 倒序存放时先放文档中靠后的片段
+	undoCollect(rec, back ? right : p->left, back);
+	undoPushSpan(rec, (undoSpan){p->add, p->start, p->len, p->nl}, back);
+	undoCollect(rec, back ? p->left : right, back);
+}
+
+// 删除的内容是从片段表取下的子树 m
+void undoRecordDelete(size_t off, size_t len, int m)
+{
+	undoLog *u = &E.undo;
+	int n = undoCountPieces(m);
+	undoRecord *top = u->top;
+	bool mergeable = !u->sealed && top && top == u->last && !top->insert;
+	if (mergeable && off + len == top->off && (top->back || top->nspans == 1) && undoGrow(top, n))
+	{
+		// 连续退格
+		top->back = true;
+		undoCollect(top, m, true);
+		undoFit(top);
+		top->off = off;
+		top->len += len;
+	}
+	else if (mergeable && off == top->off && !top->back && undoGrow(top, n))
+	{
+		// 连续向后删除
+		undoCollect(top, m, false);
+		undoFit(top);
+		top->len += len;
+	}
+	else
+	{
+		undoRecord *rec = undoAppend(false, off, len, n);
+		undoCollect(rec, m, false);
+		undoFit(rec);
+	}
+	u->sealed = false;
+}
+
+void undoFree()
+{
+	arenaFree(&E.undo.mem);
+	E.undo.first = E.undo.last = E.undo.top = NULL;
+	E.undo.sealed = true;
+}
+
+#pragma endregion
+
+/*** row operations ***/
+#pragma region
+
+// 判断字符是否是多字节的一部分 10XXXXXX
+bool is_continuation_byte(char c) {
+    return (c & 0xC0) == 0x80;
+}
+
+// 计算行的分类标记，含有非 ASCII 字符时再检查 UTF-8 是否合法
+void editorRowClassify(erow *row)
+{
+	row->flags = scanClassify(row->chars, row->size);
+	if (row->flags & ROW_ASCII)
+		return;
+	for (int i = 0; i < row->size;)
+	{
+		// 整段 ASCII 一次跳过 8 字节
+		if (i + 8 <= row->size)
+		{
+			uint64_t v;
+			memcpy(&v, &row->chars[i], 8);
+			if ((v & 0x8080808080808080ULL) == 0)
+			{
+				i += 8;
+				continue;
+			}
+		}
+		if ((unsigned char)row->chars[i] < 0x80)
+		{
+			i++;
+			continue;
+		}
+		uint32_t cp;
+		int len = utf8Decode(&row->chars[i], row->size - i, &cp);
+		if (len == 1)
+		{
+			row->flags |= ROW_INVALID;
+			return;
+		}
+		i += len;
+	}
+}
+
+// 只有 ASCII 且没有 tab 的行，字节、列和 render 一一对应
+static inline bool editorRowPlain(erow *row)
+{
+	return (row->flags & (ROW_ASCII | ROW_TAB)) == ROW_ASCII;
+}
+
+// cx 处字符的宽度和字节数；不合法的行中 utf8Decode 拒绝的字节（包括多余的后续字节）各占一列
+int editorRowCharWidth(erow *row, int cx, int *len)
+{
+	if (!(row->flags & ROW_INVALID) || (unsigned char)row->chars[cx] < 0x80)
+		return utf8Width(&row->chars[cx], row->size - cx, len);
+	uint32_t cp;
+	*len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+	return unicodeWidth(cp);
+}
+
+// 包含字节 end - 1 的字符的首字节；不合法的行中后续字节只有和前面的首字节组成合法字符时才属于它
+int editorRowCharStart(erow *row, int end)
+{
+	int start = end - 1;
+	while (start > 0 && start > end - 4 && is_continuation_byte(row->chars[start]))
+		start--;
+	if (row->flags & ROW_INVALID)
+	{
+		int len;
+		editorRowCharWidth(row, start, &len);
+		if (start + len < end)
+			return end - 1;
+	}
+	return start;
+}
+
+// 从第 col 列开始，chars[at, at + n) 之后的显示列
+int editorRowColumns(erow *row, int at, int n, int col)
+{
+	if (!(row->flags & ROW_INVALID))
+		return scanColumns(&row->chars[at], n, row->size - at, col);
+
+	int i = at;
+	// 检查点可能落在合法字符中间，这个字符已计入之前的列
+	if (n > 0 && is_continuation_byte(row->chars[i]))
+	{
+		int start = editorRowCharStart(row, i + 1);
+		if (start < i)
+		{
+			int len;
+			editorRowCharWidth(row, start, &len);
+			i = start + len;
+		}
+	}
+	while (i < at + n)
+	{
+		int len = 1;
+		if (row->chars[i] == '\t')
+			col += VEITOR_TAP_STOP - (col % VEITOR_TAP_STOP);
+		else
+			col += editorRowCharWidth(row, i, &len);
+		i += len;
+	}
+	return col;
+}
+
+// cx 处字符之后的位置，跟在后面的零宽字符（组合符号等）一起跳过
+int editorRowNextChar(erow *row, int cx)
+{
+	if (row->flags & ROW_ASCII)
+		return cx + 1;
+	int len;
+	editorRowCharWidth(row, cx, &len);
+	cx += len;
+	while (cx < row->size && (unsigned char)row->chars[cx] >= 0x80)
+	{
+		if (editorRowCharWidth(row, cx, &len) != 0)
+			break;
+		cx += len;
+	}
+	return cx;
+}
+
+// cx 之前一个字符的首字节，零宽字符和前面的字符一起跳过
+int editorRowPrevChar(erow *row, int cx)
+{
+	if (row->flags & ROW_ASCII)
+		return cx > 0 ? cx - 1 : 0;
+	while (cx > 0)
+	{
+		cx = editorRowCharStart(row, cx);
+		int len;
+		if (editorRowCharWidth(row, cx, &len) != 0)
+			break;
+	}
+	return cx;
+}
+
+// 长行第一次使用时建立列索引
+void editorRowIndexColumns(erow *row)
+{
+	int n = row->size / VEITOR_COLIDX_STEP + 1;
+	row->colidx = malloc(sizeof(int) * n);
+	if (row->colidx == NULL)
+		die("malloc");
+
+	row->colidx[0] = 0;
+	for (int k = 1; k < n; k++)
+		row->colidx[k] = editorRowColumns(row, (k - 1) * VEITOR_COLIDX_STEP, VEITOR_COLIDX_STEP, row->colidx[k - 1]);
+}
+
+// 将tab转换为指定空格长度，实现tab的秘密   ；按照码点查表得到宽度
+int editorRowCxToRx(erow *row, int cx) 
+{
+	if (editorRowPlain(row))
+		return cx;
+	if (row->size < VEITOR_COLIDX_MIN)
+		return editorRowColumns(row, 0, cx, 0);
+
+	// 从 cx 之前最近的检查点开始计算
+	if (row->colidx == NULL)
+		editorRowIndexColumns(row);
+	int k = cx / VEITOR_COLIDX_STEP;
+	int at = k * VEITOR_COLIDX_STEP;
+	return editorRowColumns(row, at, cx - at, row->colidx[k]);
+}
+
+// 由显示列找到所在字符的起始字节
+int editorRowRxToCx(erow *row, int rx)
+{
+	if (editorRowPlain(row))
+		return rx < row->size ? rx : row->size;
+	int cx = 0;
+	int cur = 0;
+	if (row->size >= VEITOR_COLIDX_MIN)
+	{
+		if (row->colidx == NULL)
+			editorRowIndexColumns(row);
+		// 二分查找显示列不超过 rx 的最后一个检查点
+		int lo = 0, hi = row->size / VEITOR_COLIDX_STEP;
+		while (lo < hi)
+		{
+			int mid = (lo + hi + 1) / 2;
+			if (row->colidx[mid] <= rx)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		cx = lo * VEITOR_COLIDX_STEP;
+		cur = row->colidx[lo];
+	}
+
+	// 后续字节不占列，只会停在字符的首字节上
+	while (cx < row->size)
+	{
+		int next = editorRowColumns(row, cx, 1, cur);
+		if (next > rx)
+			break;
+		cur = next;
+		cx++;
+	}
+	// 检查点可能落在多字节字符中间
+	while (!(row->flags & ROW_INVALID) && cx < row->size && is_continuation_byte(row->chars[cx]))
+		cx++;
+	return cx;
+}
+
+// 生成 row 的 render
+void editorUpdateRow(struct erow *row)
+{
+	if (!(row->flags & ROW_ALIAS))
+		free(row->render);
+	// 没有 tab 且 UTF-8 合法时 render 与 chars 相同，直接引用
+	if (!(row->flags & (ROW_TAB | ROW_INVALID)))
+	{
+		row->render = row->chars;
+		row->rsize = row->size;
+		row->flags |= ROW_ALIAS;
+		return;
+	}
+	row->flags &= ~ROW_ALIAS;
+
+	int tab = scanCountTabs(row->chars, row->size);
+	row->render = malloc(row->size + tab * (VEITOR_TAP_STOP - 1) + 1);
+	if (row->render == NULL)
+		die("malloc");
+
+	// 只有 tab 需要展开，其余字节整段复制；制表位按显示列对齐
+	int index = 0;
+	int j = 0;
+	int col = 0;
+	while (j < row->size)
+	{
+		char *tabp = tab ? memchr(&row->chars[j], '\t', row->size - j) : NULL;
+		int run = tabp ? tabp - &row->chars[j] : row->size - j;
+		memcpy(&row->render[index], &row->chars[j], run);
+		index += run;
+		if (tabp)
+		{
+			col = editorRowColumns(row, j, run, col);
+			int n = VEITOR_TAP_STOP - (col % VEITOR_TAP_STOP);
+			memset(&row->render[index], ' ', n);
+			index += n;
+			col += n;
+			j++;
+		}
+		j += run;
+	}
+	// 不合法的行中 utf8Decode 拒绝的字节显示为一个 '?'，合法的字符照常显示；
+	// tab 换成空格不改变前后字节的解码结果
+	for (int k = 0; (row->flags & ROW_INVALID) && k < index;)
+	{
+		uint32_t cp;
+		int len = utf8Decode(&row->render[k], index - k, &cp);
+		if (len == 1 && (unsigned char)row->render[k] >= 0x80)
+			row->render[k] = '?';
+		k += len;
+	}
+	row->render[index] = '\0';
+	row->rsize = index;
+}
+
+// 保证 row 数组至少能容纳 cap 行
+void editorReserveRows(int cap)
+{
+	if (cap <= E.rowcap)
+		return;
+	erow *new = realloc(E.row, sizeof(erow) * cap);
+	if (new == NULL)
+		die("realloc");
+	E.row = new;
+	E.rowcap = cap;
+}
+
+// 读取文件内容
+void editorAppendRow(char *s, size_t len)
+{
+	// 容量按倍数增长，避免每行都 realloc
+	if (E.numrows >= E.rowcap)
+		editorReserveRows(E.rowcap ? E.rowcap * 2 : 1024);
+
+	int at = E.numrows;
+	E.row[at].size = len;
+	E.row[at].chars = arenaAlloc(&E.rowarena, len + 1);
+	memcpy(E.row[at].chars, s, len);
+	E.row[at].chars[len] = '\0';
+
+	E.row[at].rsize = 0;
+	E.row[at].rcslot = -1;
+	E.row[at].render = NULL;
+	E.row[at].colidx = NULL;
+	E.row[at].hl = NULL;
+	editorRowClassify(&E.row[at]);
+
+	E.numrows++;
+}
+
+// 第 k 行的起始偏移
+size_t editorLineOffset(int k)
+{
+	return E.lineblk[k >> VEITOR_LINEBLK_SHIFT][k & ((1 << VEITOR_LINEBLK_SHIFT) - 1)];
+}
+
+// 行是否按需生成在槽位中（视图模式或编辑过之后）
+bool editorRowsSlotted()
+{
+	return E.viewmode || E.pt.active;
+}
+
+// 取得第 at 行，视图模式下从映射中生成，chars 直接指向文件内容；
+// 编辑过之后从片段表生成，跨片段的行复制到槽位缓冲区
+erow *editorRowAt(int at)
+{
+	if (!editorRowsSlotted())
+		return &E.row[at];
+
+	int slot = at & (E.rowcachesize - 1);
+	erow *row = &E.rowcache[slot];
+	if (E.rowcacheidx[slot] == at)
+		return row;
+
+	char *chars;
+	size_t size;
+	if (E.pt.active)
+	{
+		size_t start = ptLineStart(at);
+		size = ptLineStart(at + 1) - 1 - start;
+		chars = ptSpan(start, size);
+		if (chars == NULL)
+		{
+			struct abuf *buf = &E.rowcachebuf[slot];
+			buf->len = 0;
+			if (!abReserve(buf, size + 1))
+				die("realloc");
+			ptCopy(E.pt.root, start, size, buf->b);
+			chars = buf->b;
+		}
+	}
+	else
+	{
+		chars = E.map + editorLineOffset(at);
+		size = editorLineOffset(at + 1) - editorLineOffset(at);
+	}
+	while (size > 0 && (chars[size - 1] == '\n' || chars[size - 1] == '\r'))
+		size--;
+
+	// 槽位换给新行前先释放旧行的 render
+	editorRenderRelease(row);
+	free(row->colidx);
+	row->colidx = NULL;
+	row->chars = chars;
+	row->size = size;
+	editorRowClassify(row);
+	E.rowcacheidx[slot] = at;
+	return row;
+}
+
+// 编辑后丢弃 [from, to) 中已生成的行，to 为 -1 表示直到末尾
+void editorInvalidateRows(int from, int to)
+{
+	for (int i = 0; i < E.rowcachesize; i++)
+	{
+		int at = E.rowcacheidx[i];
+		if (at < from || (to != -1 && at >= to))
+			continue;
+		editorRenderRelease(&E.rowcache[i]);
+		free(E.rowcache[i].colidx);
+		E.rowcache[i].colidx = NULL;
+		E.rowcacheidx[i] = -1;
+	}
+}
+
+// 视图模式下按屏幕大小分配行槽位
+void editorResizeRowCache()
+{
+	if (!editorRowsSlotted())
+		return;
+
+	// 槽位数取不小于两倍屏幕行数的 2 的幂，保证可见行互不冲突
+	int size = 1;
+	while (size < E.screenrows * 2)
+		size <<= 1;
+	if (size == E.rowcachesize)
+		return;
+
+	for (int i = 0; i < E.rowcachesize; i++)
+	{
+		editorRenderRelease(&E.rowcache[i]);
+		free(E.rowcache[i].colidx);
+		abFree(&E.rowcachebuf[i]);
+	}
+	free(E.rowcache);
+	free(E.rowcacheidx);
+	free(E.rowcachebuf);
+
+	E.rowcachesize = size;
+	E.rowcache = calloc(size, sizeof(erow));
+	E.rowcacheidx = malloc(sizeof(int) * size);
+	E.rowcachebuf = calloc(size, sizeof(struct abuf));
+	if (E.rowcache == NULL || E.rowcacheidx == NULL || E.rowcachebuf == NULL)
+		die("malloc");
+	for (int i = 0; i < size; i++)
+	{
+		E.rowcache[i].rcslot = -1;
+		E.rowcacheidx[i] = -1;
+	}
+}
+
+// 返回已存在的第 at 行，视图模式下未生成的行返回 NULL
+erow *editorCachedRow(int at)
+{
+	if (!editorRowsSlotted())
+		return &E.row[at];
+
+	int slot = at & (E.rowcachesize - 1);
+	return E.rowcacheidx[slot] == at ? &E.rowcache[slot] : NULL;
+}
+
+#pragma endregion
+
+/*** syntax highlighting ***/
+#pragma region
+
+bool is_separator(int c)
+{
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:", c) != NULL;
+}
+
+// 从状态 state 开始扫描一行，返回行末状态；hl 为 NULL 时只计算状态
+int editorLexRow(const char *s, int len, unsigned char *hl, int state)
+{
+	struct editorSyntax *syn = E.syntax;
+	char *scs = syn->singleline_comment_start;
+	char *mcs = syn->multiline_comment_start;
+	char *mce = syn->multiline_comment_end;
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	bool prev_sep = true;
+	bool prev_number = false;	// 前一个字节属于数字
+	int in_string = 0;
+	bool in_comment = state == HL_STATE_COMMENT;
+	int i = 0;
+	while (i < len)
+	{
+		char c = s[i];
+		bool after_number = prev_number;
+		prev_number = false;
+
+		if (in_comment)
+		{
+			if (mce_len && len - i >= mce_len && !strncmp(&s[i], mce, mce_len))
+			{
+				if (hl)
+					memset(&hl[i], HL_MLCOMMENT, mce_len);
+				i += mce_len;
+				in_comment = false;
+				prev_sep = true;
+				continue;
+			}
+			if (hl)
+				hl[i] = HL_MLCOMMENT;
+			i++;
+			continue;
+		}
+
+		if (in_string)
+		{
+			if (hl)
+				hl[i] = HL_STRING;
+			if (c == '\\' && i + 1 < len)
+			{
+				if (hl)
+					hl[i + 1] = HL_STRING;
+				i += 2;
+				continue;
+			}
+			if (c == in_string)
+				in_string = 0;
+			i++;
+			prev_sep = true;
+			continue;
+		}
+
+		// 单行注释直接到行末
+		if (scs_len && len - i >= scs_len && !strncmp(&s[i], scs, scs_len))
+		{
+			if (hl)
+				memset(&hl[i], HL_COMMENT, len - i);
+			break;
+		}
+		if (mcs_len && len - i >= mcs_len && !strncmp(&s[i], mcs, mcs_len))
+		{
+			if (hl)
+				memset(&hl[i], HL_MLCOMMENT, mcs_len);
+			i += mcs_len;
+			in_comment = true;
+			continue;
+		}
+
+		if ((syn->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+		{
+			in_string = c;
+			if (hl)
+				hl[i] = HL_STRING;
+			i++;
+			continue;
+		}
+
+		if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+			((isdigit((unsigned char)c) && (prev_sep || after_number)) ||
+			 (c == '.' && after_number)))
+		{
+			if (hl)
+				hl[i] = HL_NUMBER;
+			i++;
+			prev_sep = false;
+			prev_number = true;
+			continue;
+		}
+
+		// 关键字前后都必须是分隔符，先比较首字节
+		if (prev_sep && (isalpha((unsigned char)c) || c == '#' || c == '_'))
+		{
+			int j;
+			for (j = 0; syn->keywords[j]; j++)
+			{
+				if (syn->keywords[j][0] != c)
+					continue;
+				int klen = strlen(syn->keywords[j]);
+				bool kw2 = syn->keywords[j][klen - 1] == '|';
+				if (kw2)
+					klen--;
+				if (len - i >= klen && !strncmp(&s[i], syn->keywords[j], klen) &&
+					(i + klen == len || is_separator((unsigned char)s[i + klen])))
+				{
+					if (hl)
+						memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+					i += klen;
+					break;
+				}
+			}
+			if (syn->keywords[j] != NULL)
+			{
+				prev_sep = false;
+				continue;
+			}
+		}
+
+		if (hl)
+			hl[i] = HL_NORMAL;
+		prev_sep = is_separator((unsigned char)c);
+		i++;
+	}
+	return in_comment ? HL_STATE_COMMENT : 0;
+}
+
+int editorSyntaxToColor(int hl)
+{
+	switch (hl)
+	{
+	case HL_COMMENT:
+	case HL_MLCOMMENT:
+		return 36;
+	case HL_KEYWORD1:
+		return 33;
+	case HL_KEYWORD2:
+		return 32;
+	case HL_STRING:
+		return 35;
+	case HL_NUMBER:
+		return 31;
+	default:
+		return 39;
+	}
+}
+
+// 保证状态数组覆盖 n 行，新增的行都需要计算
+void editorSyntaxReserve(int n)
+{
+	if (n <= E.hlstatecap)
+		return;
+	int cap = E.hlstatecap ? E.hlstatecap : 1024;
+	while (cap < n)
+		cap *= 2;
+	unsigned char *new = realloc(E.hlstate, cap);
+	if (new == NULL)
+		die("realloc");
+	memset(new + E.hlstatecap, HL_STATE_DIRTY, cap - E.hlstatecap);
+	E.hlstate = new;
+	E.hlstatecap = cap;
+}
+
+// 更新第 at 行的行末状态，变化时下一行的高亮失效
+void editorSyntaxSetState(int at, int state)
+{
+	bool changed = (E.hlstate[at] & ~HL_STATE_DIRTY) != state;
+	E.hlstate[at] = state;
+	if (!changed || at + 1 >= E.numrows)
+		return;
+	E.hlstate[at + 1] |= HL_STATE_DIRTY;
+	erow *next = editorCachedRow(at + 1);
+	if (next)
+		editorRenderRelease(next);
+}
+
+// 第 at 行的起始状态，先按顺序补算此前需要重新计算的行
+int editorSyntaxStartState(int at)
+{
+	// 显示到跳过的行时退回跳过的起点，按同样的规则重新补算
+	if (E.hlskip != -1 && at > E.hlskip && at < E.hldirty)
+	{
+		E.hldirty = E.hlskip;
+		E.hlskip = -1;
+	}
+	if (at - E.hldirty > VEITOR_HL_SYNC)
+	{
+		if (E.hlskip == -1 || E.hlskip > E.hldirty)
+			E.hlskip = E.hldirty;
+		E.hldirty = at - VEITOR_HL_SYNC;
+	}
+	for (; E.hldirty < at; E.hldirty++)
+	{
+		int k = E.hldirty;
+		if (!(E.hlstate[k] & HL_STATE_DIRTY))
+			continue;
+		int state = k == 0 ? 0 : E.hlstate[k - 1] & ~HL_STATE_DIRTY;
+		erow *row = editorRowAt(k);
+		editorSyntaxSetState(k, editorLexRow(row->chars, row->size, NULL, state));
+	}
+	return at == 0 ? 0 : E.hlstate[at - 1] & ~HL_STATE_DIRTY;
+}
+
+// 生成 row 的高亮，start 为行首状态
+void editorSyntaxUpdateRow(int at, erow *row, int start)
+{
+	free(row->hl);
+	row->hl = malloc(row->rsize + 1);
+	if (row->hl == NULL)
+		die("malloc");
+	editorSyntaxSetState(at, editorLexRow(row->render, row->rsize, row->hl, start));
+}
+
+// 编辑后平移状态数组，旧的 [at, oldend) 行被新的 [at, newend) 行替换，
+// 新的最后一行保留旧的行末状态，重新计算后相同则后面的行不受影响
+void editorSyntaxEdit(int at, int oldrows)
+{
+	if (E.syntax == NULL)
+		return;
+	int delta = E.numrows - oldrows;
+	editorSyntaxReserve((E.numrows > oldrows ? E.numrows : oldrows) + 1);
+	int oldend = at + 1 + (delta < 0 ? -delta : 0);
+	int newend = at + 1 + (delta > 0 ? delta : 0);
+	unsigned char last = E.hlstate[oldend - 1];
+	if (oldend < oldrows)
+		memmove(E.hlstate + newend, E.hlstate + oldend, oldrows - oldend);
+	memset(E.hlstate + at, HL_STATE_DIRTY, newend - at);
+	E.hlstate[newend - 1] = last | HL_STATE_DIRTY;
+	if (E.hldirty > at)
+		E.hldirty = at;
+	if (E.hlskip >= E.hldirty)
+		E.hlskip = -1;
+}
+
+// 按文件名选择高亮规则
+void editorSelectSyntax()
+{
+	E.syntax = NULL;
+	free(E.hlstate);
+	E.hlstate = NULL;
+	E.hlstatecap = 0;
+	E.hldirty = 0;
+	E.hlskip = -1;
+	if (E.filename == NULL)
+		return;
+
+	char *base = strrchr(E.filename, '/');
+	base = base ? base + 1 : E.filename;
+	char *ext = strrchr(base, '.');
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+	{
+		for (int i = 0; HLDB[j].filematch[i]; i++)
+		{
+			char *m = HLDB[j].filematch[i];
+			if ((m[0] == '.' && ext && !strcmp(ext, m)) || (m[0] != '.' && !strcmp(base, m)))
+			{
+				E.syntax = &HLDB[j];
+				return;
+			}
+		}
+	}
+}
+
+#pragma endregion
+
+/*** render cache ***/
+#pragma region
+
+void editorRenderUnlink(int i)
+{
+	renderEntry *e = &E.rcache[i];
+	if (e->prev != -1)
+		E.rcache[e->prev].next = e->next;
+	else
+		E.rcachehead = e->next;
+	if (e->next != -1)
+		E.rcache[e->next].prev = e->prev;
+	else
+		E.rcachetail = e->prev;
+}
+
+void editorRenderLinkHead(int i)
+{
+	renderEntry *e = &E.rcache[i];
+	e->prev = -1;
+	e->next = E.rcachehead;
+	if (E.rcachehead != -1)
+		E.rcache[E.rcachehead].prev = i;
+	E.rcachehead = i;
+	if (E.rcachetail == -1)
+		E.rcachetail = i;
+}
+
+// 释放行的 render 并从缓存中移除
+void editorRenderRelease(erow *row)
+{
+	// 不在缓存中的行只可能引用了 chars
+	if (row->rcslot == -1)
+	{
+		row->render = NULL;
+		row->flags &= ~ROW_ALIAS;
+		return;
+	}
+
+	int i = row->rcslot;
+	editorRenderUnlink(i);
+	E.rcachebytes -= E.rcache[i].bytes;
+	E.rcache[i].next = E.rcachefree;
+	E.rcachefree = i;
+
+	if (!(row->flags & ROW_ALIAS))
+		free(row->render);
+	free(row->hl);
+	row->render = NULL;
+	row->hl = NULL;
+	row->rsize = 0;
+	row->rcslot = -1;
+	row->flags &= ~ROW_ALIAS;
+}
+
+// 淘汰最久未用的 render，当前帧用过的行保留
+void editorRenderEvict()
+{
+	while (E.rcachebytes > VEITOR_RENDER_CACHE_MAX && E.rcachetail != -1)
+	{
+		renderEntry *e = &E.rcache[E.rcachetail];
+		if (e->frame == E.frame)
+			break;
+		editorRenderRelease(editorCachedRow(e->row));
+	}
+}
+
+// 取得第 at 行，并保证其 render 已生成
+erow *editorRenderRow(int at)
+{
+	// 先确定起始状态，上一行状态变化时本行已有的 render 随之失效；
+	// 补算会生成前面的行，要在取得本行之前完成
+	int start = 0;
+	if (E.syntax)
+	{
+		editorSyntaxReserve(E.numrows + 1);
+		start = editorSyntaxStartState(at);
+	}
+
+	erow *row = editorCachedRow(at);
+	int i = row ? row->rcslot : -1;
+	if (i != -1)
+	{
+		editorRenderUnlink(i);
+		editorRenderLinkHead(i);
+		E.rcache[i].frame = E.frame;
+		return row;
+	}
+
+	row = editorRowAt(at);
+	// 没有高亮、没有 tab 且 UTF-8 合法的行直接显示 chars，不占用缓存
+	if (E.syntax == NULL && !(row->flags & (ROW_TAB | ROW_INVALID)))
+	{
+		row->render = row->chars;
+		row->rsize = row->size;
+		row->flags |= ROW_ALIAS;
+		return row;
+	}
+
+	STATS_START(t);
+	editorUpdateRow(row);
+	if (E.syntax)
+		editorSyntaxUpdateRow(at, row, start);
+	STATS_STOP(STAT_RENDER, t);
+	STATS_COUNT(rows_rendered, 1);
+
+	if (E.rcachefree == -1)
+	{
+		int cap = E.rcachecap ? E.rcachecap * 2 : 256;
+		E.rcache = realloc(E.rcache, sizeof(renderEntry) * cap);
+		if (E.rcache == NULL)
+			die("realloc");
+		for (int j = E.rcachecap; j < cap; j++)
+			E.rcache[j].next = j + 1 < cap ? j + 1 : -1;
+		E.rcachefree = E.rcachecap;
+		E.rcachecap = cap;
+	}
+	i = E.rcachefree;
+	E.rcachefree = E.rcache[i].next;
+
+	renderEntry *e = &E.rcache[i];
+	e->row = at;
+	e->bytes = (row->flags & ROW_ALIAS ? 0 : row->rsize + 1) + (row->hl ? row->rsize + 1 : 0);
+	e->frame = E.frame;
+	editorRenderLinkHead(i);
+	row->rcslot = i;
+	E.rcachebytes += e->bytes;
+
+	editorRenderEvict();
+	return row;
+}
+
+// 释放所有行，文本随分配器整体释放
+void editorFreeRows()
+{
+	while (E.rcachehead != -1)
+		editorRenderRelease(editorCachedRow(E.rcache[E.rcachehead].row));
+
+	for (int i = 0; !editorRowsSlotted() && i < E.numrows; i++)
+		free(E.row[i].colidx);
+	for (int i = 0; i < E.rowcachesize; i++)
+	{
+		free(E.rowcache[i].colidx);
+		abFree(&E.rowcachebuf[i]);
+	}
+	ptFree();
+	undoFree();
+	free(E.row);
+	E.row = NULL;
+	E.rowcap = 0;
+	arenaFree(&E.rowarena);
+
+	// 加载线程还在读取映射，先让它停下
+	editorLoaderStop();
+	editorCacheClose();
+	if (E.map)
+		munmap(E.map, E.mapsize);
+	if (E.mapfd != -1)
+		close(E.mapfd);
+	E.map = NULL;
+	E.mapsize = 0;
+	E.mapfd = -1;
+	for (int i = 0; i < E.lineblkcount; i++)
+		free(E.lineblk[i]);
+	free(E.lineblk);
+	E.lineblk = NULL;
+	E.lineblkcount = 0;
+	free(E.rowcache);
+	free(E.rowcacheidx);
+	free(E.rowcachebuf);
+	E.rowcache = NULL;
+	E.rowcacheidx = NULL;
+	E.rowcachebuf = NULL;
+	E.rowcachesize = 0;
+
+	E.viewmode = false;
+	E.dirty = 0;
+	E.indexed = true;
+	E.numrows = 0;
+}
+
+#pragma endregion
+
+/*** editor operations ***/
+#pragma region
+
+// 等待行索引完成，缓存文件可能还在后台写入
+void editorLoaderWait()
+{
+	while (E.loader.active && !E.indexed)
+	{
+		struct pollfd fd = {E.loader.notify[0], POLLIN, 0};
+		poll(&fd, 1, -1);
+		editorLoaderUpdate();
+	}
+}
+
+// 普通模式下按行长度建立原始文本的行起始偏移，每行末尾视为有一个换行
+void editorIndexRows()
+{
+	if (E.viewmode || E.lineblk)
+		return;
+
+	E.lineblkcount = (E.numrows >> VEITOR_LINEBLK_SHIFT) + 1;
+	E.lineblk = calloc(E.lineblkcount, sizeof(size_t *));
+	if (E.lineblk == NULL)
+		die("calloc");
+	size_t total = 0;
+	editorLineStore(0, 0);
+	for (int i = 0; i < E.numrows; i++)
+	{
+		total += E.row[i].size + 1;
+		editorLineStore(i + 1, total);
+	}
+	E.pt.orignl = E.numrows;
+}
+
+// 第一次编辑前把当前文本冻结为原始文本并建立片段表
+bool editorBeginEdit()
+{
+	if (E.readonly)
+	{
+		editorSetStatusMessage("Read-only: opened with -v");
+		return false;
+	}
+	if (E.pt.active)
+		return true;
+	if (E.stream.fd != -1)
+	{
+		editorSetStatusMessage("Still reading stdin");
+		return false;
+	}
+	// 编辑后不再跟随文件
+	if (E.follow.active)
+		editorFollowStop();
+
+	// 片段表需要完整的行索引，等待后台加载结束
+	editorLoaderWait();
+
+	size_t total;
+	bool partial = false;
+	if (E.viewmode)
+	{
+		total = E.mapsize;
+		partial = E.mapsize > 0 && E.map[E.mapsize - 1] != '\n';
+		E.pt.orignl = partial ? E.numrows - 1 : E.numrows;
+	}
+	else
+	{
+		// 普通模式的行不再单独使用，原来的 render 和列索引随之释放
+		for (int i = 0; i < E.numrows; i++)
+		{
+			editorRenderRelease(&E.row[i]);
+			free(E.row[i].colidx);
+			E.row[i].colidx = NULL;
+		}
+		editorIndexRows();
+		total = editorLineOffset(E.numrows);
+	}
+
+	E.pt.active = true;
+	if (total > 0)
+		E.pt.root = ptNewNode(false, 0, total, E.pt.orignl, rand());
+	// 最后一行没有换行时补上一个，保证每行都以换行结尾
+	if (partial)
+		ptInsert(total, "\n", 1);
+	editorResizeRowCache();
+	return true;
+}
+
+// 编辑完成后更新行数，并丢弃受影响的行
+void editorEndEdit(int at, int oldrows)
+{
+	E.numrows = ptLines();
+	E.dirty++;
+	editorInvalidateRows(at, E.numrows == oldrows ? at + 1 : -1);
+	editorSyntaxEdit(at, oldrows);
+}
+
+// 插入文本并记录到撤销日志
+void editorInsert(size_t off, const char *s, int len)
+{
+	size_t at = E.pt.add.len;
+	ptInsert(off, s, len);
+	undoRecordInsert(off, at, len);
+}
+
+// 删除文本并记录到撤销日志，删除的片段只保留引用
+void editorDelete(size_t off, size_t len)
+{
+	int m = ptRemove(off, len);
+	undoRecordDelete(off, len, m);
+	ptFreeTree(m);
+}
+
+void editorInsertChar(int c)
+{
+	if (!editorBeginEdit())
+		return;
+
+	int oldrows = E.numrows;
+	// 光标在最后一行之后时连同换行一起插入，成为新的一行
+	if (E.cy == E.numrows)
+	{
+		char s[2] = {c, '\n'};
+		editorInsert(ptTotal(), s, 2);
+	}
+	else
+	{
+		char ch = c;
+		editorInsert(ptLineStart(E.cy) + E.cx, &ch, 1);
+	}
+	editorEndEdit(E.cy, oldrows);
+	E.cx++;
+}
+
+void editorInsertNewline()
+{
+	if (!editorBeginEdit())
+		return;
+
+	int oldrows = E.numrows;
+	size_t off = E.cy == E.numrows ? ptTotal() : ptLineStart(E.cy) + E.cx;
+	editorInsert(off, "\n", 1);
+	editorEndEdit(E.cy, oldrows);
+	E.cy++;
+	E.cx = 0;
+}
+
+// 删除光标前的字符，行首时与上一行合并
+void editorDelChar()
+{
+	if (E.cy == E.numrows || (E.cx == 0 && E.cy == 0))
+		return;
+	if (!editorBeginEdit())
+		return;
+
+	int oldrows = E.numrows;
+	size_t start = ptLineStart(E.cy);
+	if (E.cx > 0)
+	{
+		// 删除整个多字节字符
+		erow *row = editorRowAt(E.cy);
+		int cx = E.cx - 1;
+		while (cx > 0 && is_continuation_byte(row->chars[cx]))
+			cx--;
+		editorDelete(start + cx, E.cx - cx);
+		editorEndEdit(E.cy, oldrows);
+		E.cx = cx;
+	}
+	else
+	{
+		// 连同行尾的 \r 一起删除
+		int size = editorRowAt(E.cy - 1)->size;
+		size_t end = ptLineStart(E.cy - 1) + size;
+		editorDelete(end, start - end);
+		editorEndEdit(E.cy - 1, oldrows);
+		E.cy--;
+		E.cx = size;
+	}
+}
+
+// 撤销或重做一条记录，光标移到修改处
+void editorApplyUndo(undoRecord *rec, bool undo)
+{
+	int oldrows = E.numrows;
+	size_t at;
+	if (rec->insert == undo)
+	{
+		ptDelete(rec->off, rec->len);
+		at = rec->off;
+	}
+	else
+	{
+		ptInsertSpans(rec->off, rec->spans, rec->nspans, rec->back);
+		at = rec->insert || rec->back ? rec->off + rec->len : rec->off;
+	}
+
+	int line = ptLineAt(rec->off);
+	E.numrows = ptLines();
+	E.dirty++;
+	editorInvalidateRows(line, -1);
+	editorSyntaxEdit(line, oldrows);
+	E.cy = ptLineAt(at);
+	E.cx = at - ptLineStart(E.cy);
+	E.undo.sealed = true;
+}
+
+void editorUndo()
+{
+	if (E.undo.top == NULL)
+	{
+		editorSetStatusMessage("Already at oldest change");
+		return;
+	}
+	editorApplyUndo(E.undo.top, true);
+	E.undo.top = E.undo.top->prev;
+}
+
+void editorRedo()
+{
+	undoRecord *rec = E.undo.top ? E.undo.top->next : E.undo.first;
+	if (rec == NULL)
+	{
+		editorSetStatusMessage("Already at newest change");
+		return;
+	}
+	editorApplyUndo(rec, false);
+	E.undo.top = rec;
+}
+
+#pragma endregion
+
+/*** find ***/
+#pragma region
+
+// 文档按字节访问：编辑过后来自片段表，否则是映射的文件或普通模式的原始文本。
+// 普通模式需要先调用 editorIndexRows；视图模式加载期间只包括已发布的行
+
+size_t editorTextSize()
+{
+	if (E.pt.active)
+		return ptTotal();
+	return E.viewmode && E.indexed ? E.mapsize : editorLineOffset(E.numrows);
+}
+
+size_t editorTextLineStart(int k)
+{
+	return E.pt.active ? ptLineStart(k) : editorLineOffset(k);
+}
+
+int editorTextLineAt(size_t off)
+{
+	if (E.pt.active)
+		return ptLineAt(off);
+	return E.numrows > 0 ? editorLineSearch(off, E.numrows - 1) : 0;
+}
+
+// 读取文档 [off, off + len)，能直接访问时返回原地址，否则复制到 buf
+const char *editorTextRead(size_t off, size_t len, struct abuf *buf)
+{
+	if (E.pt.active)
+	{
+		char *p = ptSpan(off, len);
+		if (p)
+			return p;
+	}
+	else if (E.viewmode)
+	{
+		return E.map + off;
+	}
+
+	buf->len = 0;
+	if (!abReserve(buf, len))
+		die("realloc");
+	if (E.pt.active)
+		ptCopy(E.pt.root, off, len, buf->b);
+	else
+		ptOrigCopy(off, len, buf->b);
+	return buf->b;
+}
+
+// 后台线程：分段统计整个文档中的匹配数，每段结束时检查是否取消
+void *editorSearchCountMain(void *arg)
+{
+	searchCounter *sc = arg;
+	struct abuf buf = ABUF_INIT;
+	size_t count = __atomic_load_n(&sc->count, __ATOMIC_RELAXED);
+	for (size_t off = sc->from; off < sc->total && !__atomic_load_n(&sc->cancel, __ATOMIC_RELAXED);
+		 off += VEITOR_SEARCH_CHUNK)
+	{
+		// 多读 qlen - 1 字节，跨段的匹配只在起点所在的段中计数
+		size_t len = sc->total - off;
+		if (len > VEITOR_SEARCH_CHUNK + sc->qlen - 1)
+			len = VEITOR_SEARCH_CHUNK + sc->qlen - 1;
+		const char *t = editorTextRead(off, len, &buf);
+		const char *p = t;
+		while ((p = scanFind(p, t + len - p, sc->query, sc->qlen)) != NULL)
+		{
+			count++;
+			p++;
+		}
+
+		__atomic_store_n(&sc->count, count, __ATOMIC_RELAXED);
+		if (write(sc->notify[1], "", 1) == -1)
+		{
+			// 管道已满时主线程还没有处理上一次通知
+		}
+	}
+	abFree(&buf);
+
+	__atomic_store_n(&sc->done, true, __ATOMIC_RELEASE);
+	if (write(sc->notify[1], "", 1) == -1)
+	{
+	}
+	return NULL;
+}
+
+// 取消并等待正在进行的统计
+void editorSearchStop()
+{
+	searchCounter *sc = &E.search;
+	if (sc->active)
+	{
+		__atomic_store_n(&sc->cancel, true, __ATOMIC_RELAXED);
+		pthread_join(sc->thread, NULL);
+		sc->active = false;
+	}
+	free(sc->query);
+	sc->query = NULL;
+	sc->qlen = 0;
+
+	char buf[64];
+	while (read(sc->notify[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+// 统计 [sc->from, sc->total) 中的匹配，累加到 sc->count
+void editorSearchSpawn()
+{
+	searchCounter *sc = &E.search;
+	sc->done = false;
+	sc->cancel = false;
+	if (pthread_create(&sc->thread, NULL, editorSearchCountMain, sc) != 0)
+		die("pthread_create");
+	sc->active = true;
+}
+
+void editorSearchStart(const char *query)
+{
+	searchCounter *sc = &E.search;
+	editorSearchStop();
+	if (query[0] == '\0')
+		return;
+
+	sc->query = strdup(query);
+	sc->qlen = strlen(query);
+	sc->from = 0;
+	sc->total = editorTextSize();
+	sc->count = 0;
+	editorSearchSpawn();
+}
+
+// 统计结束后文档又变长了（后台加载发布了新的行），接着统计新增的部分
+void editorSearchContinue()
+{
+	searchCounter *sc = &E.search;
+	size_t total = editorTextSize();
+	if (sc->query == NULL || sc->active || total <= sc->total)
+		return;
+	// 起点在原来末尾之前 qlen - 1 字节内的匹配之前放不下，没有计入
+	sc->from = sc->total > sc->qlen - 1 ? sc->total - (sc->qlen - 1) : 0;
+	sc->total = total;
+	editorSearchSpawn();
+}
+
+// 主线程收到通知后回收结束的线程，状态栏在下一帧显示新的计数
+void editorSearchUpdate()
+{
+	searchCounter *sc = &E.search;
+	char buf[64];
+	while (read(sc->notify[0], buf, sizeof(buf)) > 0)
+		;
+	if (sc->active && __atomic_load_n(&sc->done, __ATOMIC_ACQUIRE))
+	{
+		pthread_join(sc->thread, NULL);
+		sc->active = false;
+		editorSearchContinue();
+	}
+}
+
+// 从 from 开始向后（或从 from 之前向前）查找，到达文档一端后从另一端继续
+bool editorSearchFind(const char *q, size_t m, size_t from, bool forward, size_t *at)
+{
+	size_t total = editorTextSize();
+	if (m == 0 || total < m)
+		return false;
+
+	struct abuf buf = ABUF_INIT;
+	bool found = false;
+	// 先扫描起点附近的一小段，没有匹配再逐段加倍，附近的匹配不必读入整块
+	size_t chunk = VEITOR_SEARCH_CHUNK / 64;
+	// 最多扫描整个文档加上回绕的一段
+	for (size_t done = 0; !found && done < total + chunk; done += chunk)
+	{
+		if (done > 0 && chunk < VEITOR_SEARCH_CHUNK)
+			chunk *= 2;
+		size_t a, b;
+		if (forward)
+		{
+			if (from >= total)
+				from = 0;
+			a = from;
+			b = total - a > chunk + m - 1 ? a + chunk + m - 1 : total;
+			from = a + chunk;
+		}
+		else
+		{
+			if (from == 0)
+				from = total;
+			a = from > chunk ? from - chunk : 0;
+			b = total - from > m - 1 ? from + m - 1 : total;
+			from = a;
+		}
+
+		const char *t = editorTextRead(a, b - a, &buf);
+		const char *p = t;
+		while ((p = scanFind(p, t + (b - a) - p, q, m)) != NULL)
+		{
+			// 向前查找时取段内最后一个匹配
+			if (!forward && a + (p - t) >= b - m + 1)
+				break;
+			*at = a + (p - t);
+			found = true;
+			if (forward)
+				break;
+			p++;
+		}
+		// 扫描大文件时有新的按键就放弃，由下一次回调继续
+		if (!found && editorInputReady())
+			break;
+	}
+	abFree(&buf);
+	return found;
+}
+
+void editorFindCallback(char *query, int key)
+{
+	static size_t last = (size_t)-1;
+	static bool forward = true;
+
+	if (key == '\r' || key == '\x1b')
+	{
+		last = (size_t)-1;
+		forward = true;
+		return;
+	}
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+	{
+		forward = true;
+	}
+	else if (key == ARROW_LEFT || key == ARROW_UP)
+	{
+		forward = false;
+	}
+	else
+	{
+		// 查询改变，重新统计并从光标处开始查找
+		last = (size_t)-1;
+		forward = true;
+		editorSearchStart(query);
+	}
+
+	size_t from;
+	if (last == (size_t)-1)
+	{
+		forward = true;
+		from = E.cy < E.numrows ? editorTextLineStart(E.cy) + E.cx : editorTextSize();
+	}
+	else
+	{
+		from = forward ? last + 1 : last;
+	}
+
+	size_t at;
+	if (!editorSearchFind(query, strlen(query), from, forward, &at))
+		return;
+	last = at;
+	E.cy = editorTextLineAt(at);
+	E.cx = at - editorTextLineStart(E.cy);
+	// 让匹配所在的行显示在屏幕顶部
+	E.rowoff = E.numrows;
+}
+
+void editorFind()
+{
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_coloff = E.coloff;
+	int saved_rowoff = E.rowoff;
+
+	// 视图模式加载期间在已发布的行中查找，统计随加载进度继续
+	editorIndexRows();
+
+	char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+	editorSearchStop();
+	if (query)
+	{
+		free(query);
+	}
+	else
+	{
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.coloff = saved_coloff;
+		E.rowoff = saved_rowoff;
+	}
+}
+
+#pragma endregion
+
+/*** filter ***/
+#pragma region
+
+// 屏幕上可以移动到的行数，过滤时只算匹配的行
+int editorVisibleRows()
+{
+	return E.filter.active ? E.filter.nrows : E.numrows;
+}
+
+// 第 y 个可见行对应的文件行号
+int editorFileRow(int y)
+{
+	if (!E.filter.active)
+		return y;
+	return y < E.filter.nrows ? E.filter.rows[y] : E.numrows;
+}
+
+void filterPush(int **rows, int *n, int *cap, int row)
+{
+	if (*n > 0 && (*rows)[*n - 1] == row)
+		return;
+	if (*n == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 1024;
+		*rows = realloc(*rows, sizeof(int) * *cap);
+		if (*rows == NULL)
+			die("realloc");
+	}
+	(*rows)[(*n)++] = row;
+}
+
+// 扫描文档的一段，每找到一个匹配就跳到下一行开头继续
+void filterScanChunk(void *arg, int task)
+{
+	filterChunk *c = &((filterChunk *)arg)[task];
+	struct abuf buf = ABUF_INIT;
+	size_t total = editorTextSize();
+	size_t end = total - c->to > c->m - 1 ? c->to + c->m - 1 : total;
+	const char *t = editorTextRead(c->from, end - c->from, &buf);
+	const char *p = t;
+	while ((p = scanFind(p, t + (end - c->from) - p, c->q, c->m)) != NULL)
+	{
+		size_t at = c->from + (p - t);
+		if (at >= c->to)
+			break;
+		int line = editorTextLineAt(at);
+		filterPush(&c->rows, &c->n, &c->cap, line);
+		size_t next = editorTextLineStart(line + 1);
+		if (next >= c->to)
+			break;
+		p = t + (next - c->from);
+	}
+	abFree(&buf);
+}
+
+// 模式变长时新的匹配行一定在上一次结果中，只检查这些行
+void filterRefineChunk(void *arg, int task)
+{
+	filterChunk *c = &((filterChunk *)arg)[task];
+	struct abuf buf = ABUF_INIT;
+	for (int i = 0; i < c->nin; i++)
+	{
+		size_t start = editorTextLineStart(c->in[i]);
+		size_t len = editorTextLineStart(c->in[i] + 1) - start;
+		if (scanFind(editorTextRead(start, len, &buf), len, c->q, c->m))
+			filterPush(&c->rows, &c->n, &c->cap, c->in[i]);
+	}
+	abFree(&buf);
+}
+
+// 退出过滤视图，光标回到所在的文件行
+void editorFilterClear()
+{
+	if (!E.filter.active)
+		return;
+	E.cy = editorFileRow(E.cy);
+	free(E.filter.pattern);
+	free(E.filter.rows);
+	E.filter = (rowFilter){false, NULL, NULL, 0, 0};
+}
+
+// 线程池并行处理各段，结果按顺序追加到 rows；相邻两段可能找到同一行，拼接时去重
+void filterRun(void (*fn)(void *, int), filterChunk *chunks, int ntasks, const char *pattern,
+			   int **rows, int *n, int *cap)
+{
+	for (int i = 0; i < ntasks; i++)
+	{
+		chunks[i].q = pattern;
+		chunks[i].m = strlen(pattern);
+	}
+	poolRun(&E.pool, fn, chunks, ntasks);
+	for (int i = 0; i < ntasks; i++)
+	{
+		for (int j = 0; j < chunks[i].n; j++)
+			filterPush(rows, n, cap, chunks[i].rows[j]);
+		free(chunks[i].rows);
+	}
+	free(chunks);
+}
+
+// 分段扫描文档 [from, to) 中包含 pattern 的行
+void filterScan(const char *pattern, size_t from, size_t to, int **rows, int *n, int *cap)
+{
+	int ntasks = (to - from) / VEITOR_SEARCH_CHUNK + 1;
+	filterChunk *chunks = calloc(ntasks, sizeof(filterChunk));
+	if (chunks == NULL)
+		die("calloc");
+	for (int i = 0; i < ntasks; i++)
+	{
+		chunks[i].from = from + (size_t)i * VEITOR_SEARCH_CHUNK;
+		chunks[i].to = i == ntasks - 1 ? to : chunks[i].from + VEITOR_SEARCH_CHUNK;
+	}
+	filterRun(filterScanChunk, chunks, ntasks, pattern, rows, n, cap);
+}
+
+// 按 pattern 重新建立过滤结果；视图模式加载期间只包括已发布的行，之后的由 editorFilterAppend 补上
+void editorFilterBuild(const char *pattern)
+{
+	int row = editorFileRow(E.cy);
+	if (pattern[0] == '\0')
+	{
+		editorFilterClear();
+		return;
+	}
+
+	int *rows = NULL;
+	int n = 0, cap = 0;
+	if (E.filter.active && strstr(pattern, E.filter.pattern) != NULL)
+	{
+		int ntasks = E.filter.nrows / 4096 + 1;
+		filterChunk *chunks = calloc(ntasks, sizeof(filterChunk));
+		if (chunks == NULL)
+			die("calloc");
+		int per = E.filter.nrows / ntasks + 1;
+		for (int i = 0; i < ntasks; i++)
+		{
+			int a = i * per < E.filter.nrows ? i * per : E.filter.nrows;
+			int b = a + per < E.filter.nrows ? a + per : E.filter.nrows;
+			chunks[i].in = E.filter.rows + a;
+			chunks[i].nin = b - a;
+		}
+		filterRun(filterRefineChunk, chunks, ntasks, pattern, &rows, &n, &cap);
+	}
+	else
+	{
+		filterScan(pattern, 0, editorTextSize(), &rows, &n, &cap);
+	}
+
+	free(E.filter.pattern);
+	free(E.filter.rows);
+	E.filter = (rowFilter){true, strdup(pattern), rows, n, cap};
+
+	// 光标停在原来所在行或其后第一个匹配行
+	int lo = 0, hi = n;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (rows[mid] < row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	E.cy = lo;
+	E.cx = 0;
+	E.rowoff = 0;
+}
+
+// 后台加载发布了 from 之后的行，其中匹配的加入过滤结果
+void editorFilterAppend(int from)
+{
+	if (!E.filter.active || from >= E.numrows)
+		return;
+	filterScan(E.filter.pattern, editorTextLineStart(from), editorTextSize(),
+			   &E.filter.rows, &E.filter.nrows, &E.filter.cap);
+}
+
+void editorFilterCallback(char *query, int key)
+{
+	if (key == '\x1b')
+		editorFilterClear();
+	else if (key != '\r' && key < ARROW_LEFT)
+		editorFilterBuild(query);
+}
+
+void editorFilter()
+{
+	// 视图模式加载期间先过滤已发布的行，之后的随加载进度加入
+	editorIndexRows();
+	char *pattern = editorPrompt("Filter: %s (ESC to show all lines)", editorFilterCallback);
+	free(pattern);
+}
+
+#pragma endregion
+
+/*** file i/o ***/
+#pragma region
+
+// 写入第 k 行的起始偏移，按需分配所在的块
+void editorLineStore(int k, size_t off)
+{
+	size_t **blk = &E.lineblk[k >> VEITOR_LINEBLK_SHIFT];
+	if (*blk == NULL)
+	{
+		*blk = malloc(sizeof(size_t) << VEITOR_LINEBLK_SHIFT);
+		if (*blk == NULL)
+			die("malloc");
+	}
+	(*blk)[k & ((1 << VEITOR_LINEBLK_SHIFT) - 1)] = off;
+}
+
+// 发布已建立索引的行数并通知主线程
+void editorLoaderPublish(fileLoader *l, int rows, size_t scanned)
+{
+	__atomic_store_n(&l->scanned, scanned, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->rows, rows, __ATOMIC_RELEASE);
+	if (write(l->notify[1], "", 1) == -1)
+	{
+		// 管道已满时主线程还没有处理上一次通知
+	}
+}
+
+// FNV-1a 哈希
+uint64_t cacheHash(const char *s, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+// 映射的文件中 covered 之前一段字节的哈希
+uint64_t cacheSample(size_t covered)
+{
+	size_t n = covered < VEITOR_CACHE_SAMPLE ? covered : VEITOR_CACHE_SAMPLE;
+	return cacheHash(E.map + covered - n, n);
+}
+
+// 缓存文件的路径：$XDG_CACHE_HOME/veitor（默认 ~/.cache/veitor）下按绝对路径的哈希命名
+char *cachePath(const char *file)
+{
+	const char *env = getenv("VEITOR_CACHE");
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char dir[PATH_MAX];
+	if (env && strcmp(env, "0") == 0)
+		return NULL;
+	if (xdg && xdg[0] == '/')
+		snprintf(dir, sizeof(dir), "%s/veitor", xdg);
+	else if (home && home[0] == '/')
+		snprintf(dir, sizeof(dir), "%s/.cache/veitor", home);
+	else
+		return NULL;
+	size_t len = strlen(dir) + 32;
+	char *path = malloc(len);
+	if (path == NULL)
+		die("malloc");
+	snprintf(path, len, "%s/%016llx.idx", dir, (unsigned long long)cacheHash(file, strlen(file)));
+	return path;
+}
+
+// 打开视图模式的文件时查找行索引缓存；文件未变，或者只在末尾追加了内容时，
+// 缓存中的行交给加载线程，只需扫描之后的部分
+void editorCacheOpen(const char *filename, struct stat *st)
+{
+	indexCache *c = &E.icache;
+	if ((size_t)st->st_size < VEITOR_CACHE_MIN)
+		return;
+	c->file = realpath(filename, NULL);
+	if (c->file == NULL)
+		return;
+	c->path = cachePath(c->file);
+	if (c->path == NULL)
+	{
+		free(c->file);
+		c->file = NULL;
+		return;
+	}
+	c->st = *st;
+
+	int fd = open(c->path, O_RDONLY);
+	if (fd == -1)
+		return;
+	struct stat cst;
+	if (fstat(fd, &cst) == -1 || (size_t)cst.st_size < sizeof(indexCacheHeader))
+	{
+		close(fd);
+		return;
+	}
+	c->maplen = cst.st_size;
+	c->map = mmap(NULL, c->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED)
+	{
+		c->map = NULL;
+		return;
+	}
+
+	indexCacheHeader h;
+	memcpy(&h, c->map, sizeof(h));
+	size_t pathlen = strlen(c->file);
+	bool ok = memcmp(h.magic, VEITOR_CACHE_MAGIC, 8) == 0 &&
+			  h.dev == (uint64_t)st->st_dev && h.ino == (uint64_t)st->st_ino &&
+			  h.pathlen == pathlen && h.rows <= INT_MAX &&
+			  h.covered <= h.size && h.size <= (uint64_t)st->st_size &&
+			  sizeof(h) + pathlen + h.datalen == c->maplen &&
+			  memcmp(c->map + sizeof(h), c->file, pathlen) == 0;
+	// 大小不变时要求修改时间相同；变大时要求已缓存部分的末尾没有变化
+	ok = ok && (h.size < (uint64_t)st->st_size ||
+				(h.mtime == st->st_mtim.tv_sec && h.mtimensec == st->st_mtim.tv_nsec));
+	ok = ok && h.sample == cacheSample(h.covered);
+	if (!ok)
+	{
+		munmap(c->map, c->maplen);
+		c->map = NULL;
+		return;
+	}
+	madvise(c->map, c->maplen, MADV_SEQUENTIAL);
+	c->data = c->map + sizeof(h) + pathlen;
+	c->datalen = h.datalen;
+	c->rows = h.rows;
+	c->covered = h.covered;
+}
+
+void editorCacheClose()
+{
+	indexCache *c = &E.icache;
+	if (c->map)
+		munmap(c->map, c->maplen);
+	free(c->path);
+	free(c->file);
+	memset(c, 0, sizeof(*c));
+}
+
+// 加载线程：解码缓存中的行长度，每满一块发布一次；
+// 编码损坏时停在最后一个有效的行，之后的部分重新扫描
+int editorCacheDecode(fileLoader *l)
+{
+	indexCache *c = &E.icache;
+	const unsigned char *p = c->data;
+	const unsigned char *end = p + c->datalen;
+	size_t off = 0;
+	int rows = 0;
+	bool bad = false;
+	while (!bad && rows < c->rows && !__atomic_load_n(&l->cancel, __ATOMIC_RELAXED))
+	{
+		// 一次填满当前块，之后发布
+		int k = rows + 1;
+		editorLineStore(k, off);
+		size_t *blk = E.lineblk[k >> VEITOR_LINEBLK_SHIFT];
+		int stop = (k | ((1 << VEITOR_LINEBLK_SHIFT) - 1)) + 1;
+		if (stop > c->rows + 1)
+			stop = c->rows + 1;
+		for (; k < stop; k++)
+		{
+			uint64_t len;
+			if (p < end && *p < 0x80)
+				len = *p++;
+			else
+			{
+				len = 0;
+				int shift = 0;
+				while (p < end && (*p & 0x80) && shift < 56)
+				{
+					len |= (uint64_t)(*p++ & 0x7f) << shift;
+					shift += 7;
+				}
+				if (p == end)
+				{
+					bad = true;
+					break;
+				}
+				len |= (uint64_t)*p++ << shift;
+			}
+			// 每行至少有一个换行，偏移不会超过缓存覆盖的范围
+			if (len == 0 || len > c->covered - off)
+			{
+				bad = true;
+				break;
+			}
+			off += len;
+			blk[k & ((1 << VEITOR_LINEBLK_SHIFT) - 1)] = off;
+		}
+		rows = k - 1;
+		editorLoaderPublish(l, rows, off);
+	}
+	// 没有完整解码时缓存需要重写
+	if (rows < c->rows || off != c->covered || p != end)
+		c->data = NULL;
+	return rows;
+}
+
+// 加载线程：索引完成后把完整的行写入缓存，先写临时文件再重命名，失败时放弃
+void editorCacheWrite(fileLoader *l, int rows)
+{
+	indexCache *c = &E.icache;
+	if (c->path == NULL || rows == 0)
+		return;
+	// 末尾没有换行的一行可能还会变长，不写入缓存
+	if (E.map[E.mapsize - 1] != '\n')
+		rows--;
+	size_t covered = editorLineOffset(rows);
+	if (covered == 0 || (c->data && covered == c->covered))
+		return;
+
+	// 逐级创建缓存目录
+	char *dir = strdup(c->path);
+	if (dir == NULL)
+		die("strdup");
+	for (char *q = strchr(dir + 1, '/'); q; q = strchr(q + 1, '/'))
+	{
+		*q = '\0';
+		mkdir(dir, 0700);
+		*q = '/';
+	}
+	free(dir);
+
+	size_t tmplen = strlen(c->path) + 8;
+	char *tmp = malloc(tmplen);
+	if (tmp == NULL)
+		die("malloc");
+	snprintf(tmp, tmplen, "%s.XXXXXX", c->path);
+	int fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		free(tmp);
+		return;
+	}
+
+	indexCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, VEITOR_CACHE_MAGIC, 8);
+	h.dev = c->st.st_dev;
+	h.ino = c->st.st_ino;
+	h.size = c->st.st_size;
+	h.mtime = c->st.st_mtim.tv_sec;
+	h.mtimensec = c->st.st_mtim.tv_nsec;
+	h.covered = covered;
+	h.rows = rows;
+	h.sample = cacheSample(covered);
+	h.pathlen = strlen(c->file);
+
+	// 文件头最后写入，中途失败的缓存不会通过检查
+	unsigned char buf[1 << 16];
+	size_t n = 0;
+	bool ok = lseek(fd, sizeof(h), SEEK_SET) != -1 &&
+			  write(fd, c->file, h.pathlen) == (ssize_t)h.pathlen;
+	size_t prev = 0;
+	for (int i = 1; ok && i <= rows; i++)
+	{
+		size_t next = editorLineOffset(i);
+		uint64_t len = next - prev;
+		prev = next;
+		while (len >= 0x80)
+		{
+			buf[n++] = (len & 0x7f) | 0x80;
+			len >>= 7;
+		}
+		buf[n++] = len;
+		if (n > sizeof(buf) - 16 || i == rows)
+		{
+			ok = write(fd, buf, n) == (ssize_t)n;
+			h.datalen += n;
+			n = 0;
+			if (__atomic_load_n(&l->cancel, __ATOMIC_RELAXED))
+				ok = false;
+		}
+	}
+	ok = ok && pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp, c->path) == -1)
+		unlink(tmp);
+	free(tmp);
+}
+
+// 后台线程：分段建立行索引，每段完成后发布行数并通知主线程
+void *editorLoaderMain(void *arg)
+{
+	fileLoader *l = arg;
+	size_t *off = NULL;
+	int cap = 0;
+	int rows = 0;
+	size_t from = 0;
+	// 有缓存时先取出其中的行，只扫描之后追加的部分
+	if (E.icache.data)
+	{
+		rows = editorCacheDecode(l);
+		from = editorLineOffset(rows);
+	}
+	size_t seg = VEITOR_INDEX_SPAN;
+	// [from, scan) 已扫描过，其中没有换行；一行比整段还长时从 scan 继续，不重复扫描
+	size_t scan = from;
+	while (scan < E.mapsize && !__atomic_load_n(&l->cancel, __ATOMIC_RELAXED))
+	{
+		size_t to = E.mapsize - scan > seg ? scan + seg : E.mapsize;
+		int n = 0;
+		lineIndexScan(E.map, scan, to, to == E.mapsize, &off, &n, &cap);
+		if (seg < VEITOR_LOAD_SEGMENT)
+			seg *= 2;
+		scan = to;
+		if (n == 0)
+			continue;
+
+		for (int i = 1; i <= n; i++)
+			editorLineStore(rows + i, off[i]);
+		rows += n;
+		from = off[n];
+		editorLoaderPublish(l, rows, from);
+	}
+	free(off);
+	__atomic_store_n(&l->done, true, __ATOMIC_RELEASE);
+	if (write(l->notify[1], "", 1) == -1)
+	{
+	}
+
+	// 索引完成后再写缓存，主线程不必等待
+	if (!__atomic_load_n(&l->cancel, __ATOMIC_RELAXED))
+		editorCacheWrite(l, rows);
+	__atomic_store_n(&l->finished, true, __ATOMIC_RELEASE);
+	if (write(l->notify[1], "", 1) == -1)
+	{
+	}
+	return NULL;
+}
+
+void editorLoaderStart()
+{
+	fileLoader *l = &E.loader;
+	l->rows = 0;
+	l->scanned = 0;
+	l->done = false;
+	l->finished = false;
+	l->cancel = false;
+	if (pthread_create(&l->thread, NULL, editorLoaderMain, l) != 0)
+		die("pthread_create");
+	l->active = true;
+}
+
+// 取消并等待后台加载结束
+void editorLoaderStop()
+{
+	fileLoader *l = &E.loader;
+	if (!l->active)
+		return;
+	__atomic_store_n(&l->cancel, true, __ATOMIC_RELAXED);
+	pthread_join(l->thread, NULL);
+	l->active = false;
+
+	char buf[64];
+	while (read(l->notify[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+// 主线程收到通知后取得新发布的行
+void editorLoaderUpdate()
+{
+	fileLoader *l = &E.loader;
+	char buf[64];
+	while (read(l->notify[0], buf, sizeof(buf)) > 0)
+		;
+	if (!l->active)
+		return;
+
+	// 依次读 finished、done、rows：看到 finished 时 done 和全部的行一定可见，不会回收了线程却没标记索引完成
+	bool finished = __atomic_load_n(&l->finished, __ATOMIC_ACQUIRE);
+	bool done = finished || __atomic_load_n(&l->done, __ATOMIC_ACQUIRE);
+	// 跟随时光标在末尾就随加载进度移到新的末尾
+	bool bottom = E.follow.active && !E.filter.active && E.cy >= E.numrows - 1;
+	int oldrows = E.numrows;
+	E.numrows = __atomic_load_n(&l->rows, __ATOMIC_ACQUIRE);
+	if (bottom && E.numrows > 0)
+		E.cy = E.numrows - 1;
+	bool indexed = !E.indexed && done;
+	if (indexed)
+		E.indexed = true;
+	// 新发布的行加入过滤结果和匹配统计
+	editorFilterAppend(oldrows);
+	editorSearchContinue();
+	if (indexed)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		E.stats.load_ms = (now.tv_sec - E.stats.open_start.tv_sec) * 1000 +
+						  (now.tv_nsec - E.stats.open_start.tv_nsec) / 1000000;
+		if (E.stats.first_frame_ms >= 0)
+			editorSetStatusMessage("%d lines loaded in %ld ms (first frame after %ld ms)",
+								   E.numrows, E.stats.load_ms, E.stats.first_frame_ms);
+		else
+			editorSetStatusMessage("%d lines loaded in %ld ms", E.numrows, E.stats.load_ms);
+	}
+	// 缓存写完后回收线程，之后才能重新映射文件
+	if (finished)
+	{
+		pthread_join(l->thread, NULL);
+		l->active = false;
+		// 加载期间文件可能又增长了
+		editorFollowCheck();
+	}
+}
+
+// 以只读视图模式打开文件，只映射文件并在后台建立行索引
+bool editorOpenView(char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		die("open");
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		die("fstat");
+	// 空文件无法映射，交给普通模式
+	if (st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (E.map == MAP_FAILED)
+		die("mmap");
+	E.mapfd = fd;
+	editorFollowNote(&st, E.map[st.st_size - 1] != '\n');
+	madvise(E.map, st.st_size, MADV_SEQUENTIAL);
+
+	E.mapsize = st.st_size;
+	E.viewmode = true;
+	E.indexed = false;
+	E.numrows = 0;
+	// 行数不会超过字节数，按文件大小一次分配好块目录
+	E.lineblkcount = ((E.mapsize + 1) >> VEITOR_LINEBLK_SHIFT) + 1;
+	E.lineblk = calloc(E.lineblkcount, sizeof(size_t *));
+	if (E.lineblk == NULL)
+		die("calloc");
+	editorLineStore(0, 0);
+	editorCacheOpen(filename, &st);
+
+	editorResizeRowCache();
+	editorLoaderStart();
+	return true;
+}
+
+// 打开文件，读取
+void editorOpen(char *filename, bool viewmode)
+{
+	editorFreeRows();
+	free(E.filename);
+	E.filename = strdup(filename);
+	editorSelectSyntax();
+	clock_gettime(CLOCK_MONOTONIC, &E.stats.open_start);
+	E.stats.first_frame_ms = -1;
+
+	struct stat st;
+	if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+		(viewmode || st.st_size >= VEITOR_VIEW_THRESHOLD))
+	{
+		if (editorOpenView(filename))
+			return;
+	}
+
+	// 普通文件先映射并行建立行索引，再逐行复制
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		die("open");
+	if (fstat(fd, &st) == -1)
+		die("fstat");
+	editorFollowNote(&st, false);
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			die("mmap");
+		close(fd);
+		E.follow.partial = buf[st.st_size - 1] != '\n';
+		if (E.follow.partial)
+		{
+			char *nl = memrchr(buf, '\n', st.st_size);
+			size_t start = nl ? nl - buf + 1 : 0;
+			abAppend(&E.follow.part, buf + start, st.st_size - start);
+		}
+
+		// 分段处理，复制完的部分立即归还，峰值内存不包含整个文件
+		size_t *off = NULL;
+		int cap = 0;
+		size_t from = 0;
+		size_t seg = VEITOR_LOAD_SEGMENT;
+		long page = sysconf(_SC_PAGESIZE);
+		while (from < (size_t)st.st_size)
+		{
+			size_t to = st.st_size - from > seg ? from + seg : (size_t)st.st_size;
+			int n = 0;
+			lineIndexScan(buf, from, to, to == (size_t)st.st_size, &off, &n, &cap);
+			// 一行比整段还长时扩大分段
+			if (n == 0)
+			{
+				seg *= 2;
+				continue;
+			}
+			for (int i = 0; i < n; i++)
+			{
+				size_t end = off[i + 1];
+				while (end > off[i] && (buf[end - 1] == '\n' || buf[end - 1] == '\r'))
+					end--;
+				editorAppendRow(buf + off[i], end - off[i]);
+			}
+			from = off[n];
+			madvise(buf, from / page * page, MADV_DONTNEED);
+		}
+		free(off);
+		munmap(buf, st.st_size);
+		return;
+	}
+	close(fd);
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		die("fopen");
+
+	char *line = NULL;
+	ssize_t linecap = 0;
+	ssize_t linelen;
+	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	{
+		while (linelen > 0 && (line[linelen - 1] == '\n' ||
+							   line[linelen - 1] == '\r'))
+			linelen--;
+		editorAppendRow(line, linelen);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+// 写出已积累的片段，处理部分写入
+bool saveFlush(saveWriter *w)
+{
+	struct iovec *iov = w->iov;
+	int n = w->niov;
+	while (n > 0)
+	{
+		ssize_t r = writev(w->fd, iov, n > IOV_MAX ? IOV_MAX : n);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		w->written += r;
+		while (n > 0 && (size_t)r >= iov->iov_len)
+		{
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	w->niov = 0;
+	return true;
+}
+
+// 追加一段内存，不复制内容，与上一段相邻时合并
+bool saveAppend(saveWriter *w, const char *p, size_t len)
+{
+	if (len == 0)
+		return true;
+	if (w->niov > 0)
+	{
+		struct iovec *last = &w->iov[w->niov - 1];
+		if ((char *)last->iov_base + last->iov_len == p)
+		{
+			last->iov_len += len;
+			return true;
+		}
+	}
+	if (w->niov == VEITOR_SAVE_IOV && !saveFlush(w))
+		return false;
+	w->iov[w->niov].iov_base = (void *)p;
+	w->iov[w->niov].iov_len = len;
+	w->niov++;
+	return true;
+}
+
+// 映射文件中的 [off, off + len) 由内核直接复制，不经过用户态
+bool saveCopy(saveWriter *w, size_t off, size_t len)
+{
+	if (!w->nocopy)
+	{
+		if (!saveFlush(w))
+			return false;
+		loff_t in = off;
+		while (len > 0)
+		{
+			ssize_t r = copy_file_range(E.mapfd, &in, w->fd, NULL, len, 0);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+							errno == EOPNOTSUPP))
+			{
+				w->nocopy = true;
+				break;
+			}
+			if (r <= 0)
+				return false;
+			w->written += r;
+			len -= r;
+		}
+		off = in;
+	}
+	return saveAppend(w, E.map + off, len);
+}
+
+// 写出原始文本 [off, off + len)，普通模式下每行后补上换行
+bool saveOrig(saveWriter *w, size_t off, size_t len)
+{
+	if (E.viewmode)
+		return saveCopy(w, off, len);
+
+	int line = ptOrigNlBefore(off);
+	size_t col = off - editorLineOffset(line);
+	while (len > 0)
+	{
+		erow *row = &E.row[line];
+		size_t run = col < (size_t)row->size ? row->size - col : 0;
+		if (run > len)
+			run = len;
+		if (!saveAppend(w, row->chars + col, run))
+			return false;
+		len -= run;
+		if (len > 0)
+		{
+			if (!saveAppend(w, "\n", 1))
+				return false;
+			len--;
+		}
+		line++;
+		col = 0;
+	}
+	return true;
+}
+
+// 按顺序写出片段表的每个片段
+bool saveTree(saveWriter *w, int t)
+{
+	if (t == -1)
+		return true;
+	piece *p = &E.pt.node[t];
+	if (!saveTree(w, p->left))
+		return false;
+	if (p->add ? !saveAppend(w, E.pt.add.b + p->start, p->len) : !saveOrig(w, p->start, p->len))
+		return false;
+	return saveTree(w, p->right);
+}
+
+bool saveText(saveWriter *w)
+{
+	if (E.pt.active)
+		return saveTree(w, E.pt.root);
+	if (E.viewmode)
+		return saveCopy(w, 0, E.mapsize);
+	for (int i = 0; i < E.numrows; i++)
+	{
+		if (!saveAppend(w, E.row[i].chars, E.row[i].size) || !saveAppend(w, "\n", 1))
+			return false;
+	}
+	return true;
+}
+
+// 先写入同一目录下的临时文件，落盘后再替换原文件，中途失败不会损坏原文件
+void editorSave()
+{
+	if (E.readonly)
+	{
+		editorSetStatusMessage("Opened read-only, can't save");
+		return;
+	}
+	if (E.filename == NULL)
+	{
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename == NULL)
+		{
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntax();
+	}
+	editorLoaderWait();
+
+	// 原文件是符号链接时替换它指向的文件
+	char *target = realpath(E.filename, NULL);
+	if (target == NULL)
+		target = strdup(E.filename);
+	char *dircopy = strdup(target);
+	char *basecopy = strdup(target);
+	char *dir = dirname(dircopy);
+	size_t tmplen = strlen(target) + 16;
+	char *tmp = malloc(tmplen);
+	if (target == NULL || dircopy == NULL || basecopy == NULL || tmp == NULL)
+		die("malloc");
+	snprintf(tmp, tmplen, "%s/.%s.XXXXXX", dir, basename(basecopy));
+
+	saveWriter *w = malloc(sizeof(saveWriter));
+	if (w == NULL)
+		die("malloc");
+	w->niov = 0;
+	w->nocopy = false;
+	w->written = 0;
+	w->fd = mkstemp(tmp);
+	bool ok = w->fd != -1;
+	if (ok)
+	{
+		struct stat st;
+		fchmod(w->fd, stat(target, &st) == 0 ? st.st_mode & 07777 : 0644);
+		ok = saveText(w) && saveFlush(w) && fsync(w->fd) == 0;
+		int err = errno;
+		ok = close(w->fd) == 0 && ok;
+		ok = ok && rename(tmp, target) == 0;
+		if (!ok)
+		{
+			err = errno;
+			unlink(tmp);
+		}
+		errno = err;
+	}
+	if (ok)
+	{
+		// 目录也落盘，保证重命名本身不会丢失
+		int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+		if (dfd != -1)
+		{
+			fsync(dfd);
+			close(dfd);
+		}
+		E.dirty = 0;
+		editorSetStatusMessage("%zu bytes written to disk", w->written);
+	}
+	else
+	{
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	}
+
+	free(w);
+	free(tmp);
+	free(basecopy);
+	free(dircopy);
+	free(target);
+}
+
+#pragma endregion
+
+/*** follow ***/
+#pragma region
+
+// 记录打开的文件，之后以此判断增长、截断和轮转
+void editorFollowNote(struct stat *st, bool partial)
+{
+	E.follow.dev = st->st_dev;
+	E.follow.ino = st->st_ino;
+	E.follow.size = S_ISREG(st->st_mode) ? st->st_size : 0;
+	E.follow.partial = partial;
+	E.follow.part.len = 0;
+}
+
+// 监视文件本身的修改和移动，以及所在目录中新建的文件（轮转后的新文件）
+bool editorFollowWatch()
+{
+	if (E.follow.filewd != -1)
+		inotify_rm_watch(E.follow.inotify, E.follow.filewd);
+	E.follow.filewd = inotify_add_watch(E.follow.inotify, E.filename,
+										IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	return E.follow.filewd != -1;
+}
+
+void editorFollowStart()
+{
+	struct stat st;
+	if (E.filename == NULL || stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		editorSetStatusMessage("Follow needs a regular file");
+		return;
+	}
+	if (E.pt.active)
+	{
+		editorSetStatusMessage("Can't follow an edited buffer");
+		return;
+	}
+
+	E.follow.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (E.follow.inotify == -1)
+		die("inotify_init1");
+	char *dircopy = strdup(E.filename);
+	if (dircopy == NULL)
+		die("strdup");
+	E.follow.dirwd = inotify_add_watch(E.follow.inotify, dirname(dircopy), IN_CREATE | IN_MOVED_TO);
+	free(dircopy);
+	if (!editorFollowWatch())
+	{
+		editorFollowStop();
+		editorSetStatusMessage("Can't watch file: %s", strerror(errno));
+		return;
+	}
+	E.follow.active = true;
+	editorFollowCheck();
+}
+
+void editorFollowStop()
+{
+	if (E.follow.inotify != -1)
+		close(E.follow.inotify);
+	E.follow.inotify = -1;
+	E.follow.filewd = E.follow.dirwd = -1;
+	E.follow.active = false;
+}
+
+// 新增第 at 行的行索引，目录不够时扩大
+void editorLineStoreGrow(int at, size_t off)
+{
+	if ((at >> VEITOR_LINEBLK_SHIFT) >= E.lineblkcount)
+	{
+		int count = E.lineblkcount * 2;
+		while ((at >> VEITOR_LINEBLK_SHIFT) >= count)
+			count *= 2;
+		size_t **blk = realloc(E.lineblk, sizeof(size_t *) * count);
+		if (blk == NULL)
+			die("realloc");
+		memset(blk + E.lineblkcount, 0, sizeof(size_t *) * (count - E.lineblkcount));
+		E.lineblk = blk;
+		E.lineblkcount = count;
+	}
+	editorLineStore(at, off);
+}
+
+// 没有换行的最后一行作为一行显示，直接引用 part，末尾的 \r 不显示
+void editorFollowShowPart()
+{
+	struct abuf *part = &E.follow.part;
+	if (!abReserve(part, 1))
+		die("realloc");
+	int len = part->len;
+	while (len > 0 && part->b[len - 1] == '\r')
+		len--;
+	// 换成结束符的 \r 在下次读取前恢复
+	part->b[len] = '\0';
+
+	if (E.numrows >= E.rowcap)
+		editorReserveRows(E.rowcap ? E.rowcap * 2 : 1024);
+	erow *row = &E.row[E.numrows++];
+	row->size = len;
+	row->chars = part->b;
+	row->rsize = 0;
+	row->rcslot = -1;
+	row->render = NULL;
+	row->colidx = NULL;
+	row->hl = NULL;
+	editorRowClassify(row);
+}
+
+// 普通模式：只读取新增的字节，完整的行逐行追加，没有换行的末尾也先作为一行显示
+void editorFollowRead(size_t newsize)
+{
+	int fd = open(E.filename, O_RDONLY);
+	if (fd == -1)
+		return;
+	char *buf = malloc(VEITOR_FOLLOW_CHUNK);
+	if (buf == NULL)
+		die("malloc");
+
+	// 上次的最后一行没有结束，去掉后在 part 之后接着读
+	struct abuf *part = &E.follow.part;
+	if (E.follow.partial && E.numrows > 0)
+	{
+		erow *last = &E.row[--E.numrows];
+		editorRenderRelease(last);
+		free(last->colidx);
+		last->colidx = NULL;
+		if (last->chars == part->b && last->size < part->len)
+			part->b[last->size] = '\r';
+	}
+
+	size_t pos = E.follow.size;
+	while (pos < newsize)
+	{
+		size_t want = newsize - pos < VEITOR_FOLLOW_CHUNK ? newsize - pos : VEITOR_FOLLOW_CHUNK;
+		ssize_t n = pread(fd, buf, want, pos);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		pos += n;
+		char *p = buf;
+		char *end = buf + n;
+		char *nl;
+		while ((nl = memchr(p, '\n', end - p)) != NULL)
+		{
+			abAppend(part, p, nl - p);
+			int len = part->len;
+			while (len > 0 && part->b[len - 1] == '\r')
+				len--;
+			editorAppendRow(part->b ? part->b : "", len);
+			part->len = 0;
+			p = nl + 1;
+		}
+		abAppend(part, p, end - p);
+	}
+	E.follow.partial = part->len > 0;
+	if (E.follow.partial)
+		editorFollowShowPart();
+	E.follow.size = pos;
+	free(buf);
+	close(fd);
+}
+
+// 视图模式：扩大映射，从最后一个完整行之后继续建立索引
+void editorFollowRemap(size_t newsize)
+{
+	char *map = mremap(E.map, E.mapsize, newsize, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		return;
+	E.map = map;
+	E.mapsize = newsize;
+
+	int from = E.follow.partial && E.numrows > 0 ? E.numrows - 1 : E.numrows;
+	size_t *off = NULL;
+	int n = 0, cap = 0;
+	lineIndexScan(E.map, editorLineOffset(from), newsize, true, &off, &n, &cap);
+	for (int i = 1; i <= n; i++)
+		editorLineStoreGrow(from + i, off[i]);
+	free(off);
+	E.numrows = from + n;
+	E.follow.size = newsize;
+	E.follow.partial = E.map[newsize - 1] != '\n';
+	// 映射可能移动了位置，已生成的行都指向旧地址
+	editorInvalidateRows(0, -1);
+}
+
+// 末尾追加了 [from, E.numrows) 行之后更新行索引、高亮状态和过滤结果
+void editorRowsAppended(int from, int oldrows)
+{
+	if (!E.viewmode && E.lineblk)
+	{
+		// 普通模式的行索引已建立时继续补上新行
+		for (int i = from; i < E.numrows; i++)
+			editorLineStoreGrow(i + 1, editorLineOffset(i) + E.row[i].size + 1);
+		E.pt.orignl = E.numrows;
+	}
+	editorSyntaxEdit(from, oldrows);
+	editorInvalidateRows(from, -1);
+	// 新行中匹配的加入过滤结果
+	for (int i = from; E.filter.active && i < E.numrows; i++)
+	{
+		erow *row = editorRowAt(i);
+		if (scanFind(row->chars, row->size, E.filter.pattern, strlen(E.filter.pattern)))
+			filterPush(&E.filter.rows, &E.filter.nrows, &E.filter.cap, i);
+	}
+}
+
+// 文件被截断或替换，重新打开
+void editorFollowReload(struct stat *st)
+{
+	bool replaced = st->st_dev != E.follow.dev || st->st_ino != E.follow.ino;
+	char *filename = strdup(E.filename);
+	if (filename == NULL)
+		die("strdup");
+	editorOpen(filename, E.readonly);
+	free(filename);
+	E.cx = 0;
+	E.rowoff = 0;
+	editorFollowWatch();
+	editorSetStatusMessage(replaced ? "File replaced, reloaded" : "File truncated, reloaded");
+}
+
+// 检查文件的变化；加载未完成、加载线程还在写缓存或已编辑时不处理
+void editorFollowCheck()
+{
+	if (!E.follow.active || !E.indexed || E.loader.active || E.pt.active)
+		return;
+	struct stat st;
+	// 轮转后新文件可能还没有创建，等待目录的通知
+	if (stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+	bool replaced = st.st_dev != E.follow.dev || st.st_ino != E.follow.ino;
+	if (!replaced && (size_t)st.st_size == E.follow.size)
+		return;
+
+	// 后台统计会读取映射和行索引，更新期间先停下
+	char *query = E.search.query ? strdup(E.search.query) : NULL;
+	editorSearchStop();
+	int visible = editorVisibleRows();
+	bool bottom = E.cy >= visible - 1;
+	int oldrows = E.numrows;
+	// 没有结束的最后一行会和新内容合并，从它开始更新
+	int from = E.follow.partial && E.numrows > 0 ? E.numrows - 1 : E.numrows;
+
+	if (replaced || (size_t)st.st_size < E.follow.size)
+	{
+		editorFilterClear();
+		editorFollowReload(&st);
+		bottom = true;
+	}
+	else
+	{
+		if (E.viewmode)
+			editorFollowRemap(st.st_size);
+		else
+			editorFollowRead(st.st_size);
+		editorRowsAppended(from, oldrows);
+	}
+
+	// 光标在最后一行时跟着移到新的末尾
+	if (bottom)
+	{
+		visible = editorVisibleRows();
+		E.cy = visible > 0 ? visible - 1 : 0;
+		E.cx = 0;
+	}
+	if (query)
+	{
+		editorSearchStart(query);
+		free(query);
+	}
+}
+
+// inotify 可读时取走全部事件，合并为一次检查
+void editorFollowUpdate()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(E.follow.inotify, buf, sizeof(buf)) > 0)
+		;
+	editorFollowCheck();
+}
+
+#pragma endregion
+
+/*** stream input ***/
+#pragma region
+
+// 把标准输入换成 /dev/tty，返回原来的管道
+int editorStreamSwap()
+{
+	int fd = dup(STDIN_FILENO);
+	int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+	if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+	{
+		perror("/dev/tty");
+		exit(1);
+	}
+	close(tty);
+	return fd;
+}
+
+void editorStreamStart(int fd, int keep)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	E.stream.fd = fd;
+	E.stream.keep = keep;
+}
+
+// 只保留最后 keep 行；攒够 keep / 2 行再一起丢弃，保留的行复制到新的分配器
+void editorStreamTrim()
+{
+	int keep = E.stream.keep;
+	if (keep <= 0 || E.numrows < keep + keep / 2 + 1)
+		return;
+	int drop = E.numrows - keep;
+
+	while (E.rcachehead != -1)
+		editorRenderRelease(editorCachedRow(E.rcache[E.rcachehead].row));
+	for (int i = 0; i < drop; i++)
+		free(E.row[i].colidx);
+	arena old = E.rowarena;
+	E.rowarena = (arena){NULL, 0};
+	memmove(E.row, E.row + drop, sizeof(erow) * keep);
+	for (int i = 0; i < keep; i++)
+	{
+		char *chars = arenaAlloc(&E.rowarena, E.row[i].size + 1);
+		memcpy(chars, E.row[i].chars, E.row[i].size + 1);
+		E.row[i].chars = chars;
+	}
+	arenaFree(&old);
+	E.numrows = keep;
+	E.stream.dropped += drop;
+
+	// 行号整体前移
+	if (E.hlstate)
+	{
+		memmove(E.hlstate, E.hlstate + drop, keep);
+		memset(E.hlstate + keep, HL_STATE_DIRTY, E.hlstatecap - keep);
+		E.hldirty = E.hldirty > drop ? E.hldirty - drop : 0;
+		if (E.hlskip != -1)
+			E.hlskip = E.hlskip > drop ? E.hlskip - drop : 0;
+		if (E.hlskip >= E.hldirty)
+			E.hlskip = -1;
+	}
+	if (E.filter.active)
+	{
+		int n = 0;
+		for (int i = 0; i < E.filter.nrows; i++)
+			if (E.filter.rows[i] >= drop)
+				E.filter.rows[n++] = E.filter.rows[i] - drop;
+		E.cy -= E.filter.nrows - n;
+		E.rowoff -= E.filter.nrows - n;
+		E.filter.nrows = n;
+	}
+	else
+	{
+		E.cy -= drop;
+		E.rowoff -= drop;
+	}
+	if (E.cy < 0)
+		E.cy = 0;
+	if (E.rowoff < 0)
+		E.rowoff = 0;
+	// 行偏移都变了，已建立的行索引按保留的行重建
+	bool indexed = E.lineblk != NULL;
+	for (int i = 0; i < E.lineblkcount; i++)
+		free(E.lineblk[i]);
+	free(E.lineblk);
+	E.lineblk = NULL;
+	E.lineblkcount = 0;
+	if (indexed)
+		editorIndexRows();
+}
+
+// 管道可读时读入一批数据，完整的行追加到末尾，读完后关闭
+void editorStreamUpdate()
+{
+	char *query = E.search.query ? strdup(E.search.query) : NULL;
+	editorSearchStop();
+	bool bottom = E.cy >= editorVisibleRows() - 1;
+	int oldrows = E.numrows;
+
+	char buf[64 << 10];
+	size_t budget = 0;
+	bool eof = false;
+	while (budget < VEITOR_STREAM_BUDGET)
+	{
+		ssize_t n = read(E.stream.fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n <= 0)
+		{
+			eof = true;
+			break;
+		}
+		budget += n;
+		char *p = buf;
+		char *end = buf + n;
+		char *nl;
+		while ((nl = memchr(p, '\n', end - p)) != NULL)
+		{
+			struct abuf *t = &E.stream.tail;
+			const char *line = p;
+			int len = nl - p;
+			if (t->len > 0)
+			{
+				abAppend(t, p, len);
+				line = t->b;
+				len = t->len;
+			}
+			while (len > 0 && line[len - 1] == '\r')
+				len--;
+			editorAppendRow((char *)line, len);
+			t->len = 0;
+			p = nl + 1;
+		}
+		abAppend(&E.stream.tail, p, end - p);
+
+		// 限制行数时每读一块就检查，不让一批数据积压过多的行
+		if (E.stream.keep > 0 && E.numrows > E.stream.keep + E.stream.keep / 2)
+		{
+			editorRowsAppended(oldrows, oldrows);
+			editorStreamTrim();
+			oldrows = E.numrows;
+		}
+	}
+	E.stream.bytes += budget;
+
+	if (eof)
+	{
+		struct abuf *t = &E.stream.tail;
+		while (t->len > 0 && t->b[t->len - 1] == '\r')
+			t->len--;
+		if (t->len > 0)
+			editorAppendRow(t->b, t->len);
+		abFree(t);
+		close(E.stream.fd);
+		E.stream.fd = -1;
+		editorSetStatusMessage("%zu bytes read from stdin", E.stream.bytes);
+	}
+
+	editorRowsAppended(oldrows, oldrows);
+	editorStreamTrim();
+	if (bottom)
+	{
+		int visible = editorVisibleRows();
+		E.cy = visible > 0 ? visible - 1 : 0;
+		E.cx = 0;
+	}
+	if (query)
+	{
+		editorSearchStart(query);
+		free(query);
+	}
+}
+
+#pragma endregion
+
+/*** appenf buffer ***/
+#pragma region
+
+// 保证缓冲区还能再写入 len 字节，容量按倍数增长
+bool abReserve(struct abuf *ab, int len)
+{
+	if (ab->len + len <= ab->cap)
+		return true;
+
+	int cap = ab->cap ? ab->cap : 256;
+	while (cap < ab->len + len)
+		cap *= 2;
+	char *new = realloc(ab->b, cap);
+	if (new == NULL)
+		return false;
+	ab->b = new;
+	ab->cap = cap;
+	return true;
+}
+
+// 向结构体中添加一行文本
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+	if (len <= 0 || !abReserve(ab, len))
+		return;
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+// 追加 n 个相同的字符，用于填充空白
+void abAppendFill(struct abuf *ab, char c, int n)
+{
+	if (n <= 0 || !abReserve(ab, n))
+		return;
+	memset(&ab->b[ab->len], c, n);
+	ab->len += n;
+}
+
+void abFree(struct abuf *ab)
+{
+	free(ab->b);
+	ab->b = NULL;
+	ab->len = 0;
+	ab->cap = 0;
+}
+
+#pragma endregion
+
+/*** stats ***/
+#pragma region
+
+#if defined(VEITOR_STATS) || defined(VEITOR_BENCH)
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+unsigned long statsAllocs;	// 链接时用 --wrap 接管 malloc，统计分配次数
+
+void *__wrap_malloc(size_t n)
+{
+	__atomic_fetch_add(&statsAllocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	__atomic_fetch_add(&statsAllocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+	__atomic_fetch_add(&statsAllocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(p, n);
+}
+
+#endif
+
+#ifdef VEITOR_STATS
+
+static const char *statsStageName[STAT_STAGES] = {"open", "render", "draw", "write", "frame"};
+
+// 记录从 start 到现在的耗时
+void statsRecord(int stage, struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long ns = (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+	statsTimer *t = &E.stats.timers[stage];
+	t->count++;
+	t->total_ns += ns;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+	// 按微秒数的位数分桶
+	unsigned long us = ns / 1000;
+	int b = us ? 64 - __builtin_clzl(us) : 0;
+	if (b >= VEITOR_STATS_BUCKETS)
+		b = VEITOR_STATS_BUCKETS - 1;
+	t->hist[b]++;
+}
+
+// 分位数所在桶的上界（微秒）
+unsigned long statsPercentile(statsTimer *t, double p)
+{
+	unsigned long want = (unsigned long)(p * t->count + 0.5), seen = 0;
+	for (int b = 0; b < VEITOR_STATS_BUCKETS; b++)
+	{
+		seen += t->hist[b];
+		if (seen >= want && seen > 0)
+			return 1UL << b;
+	}
+	return 1UL << (VEITOR_STATS_BUCKETS - 1);
+}
+
+// 把微秒写成便于阅读的形式
+char *statsFormatUs(char *buf, size_t size, double us)
+{
+	if (us >= 1000)
+		snprintf(buf, size, "%.1fms", us / 1000);
+	else
+		snprintf(buf, size, "%.0fus", us);
+	return buf;
+}
+
+double statsMeanUs(statsTimer *t)
+{
+	return t->count ? t->total_ns / 1000.0 / t->count : 0;
+}
+
+// 消息栏中显示的统计
+void statsOverlay(struct abuf *line)
+{
+	statsTimer *tm = E.stats.timers;
+	char p50[16], p99[16], render[16], draw[16], wr[16], op[16];
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf),
+					   "frame %lu p50<%s p99<%s | render %lu rows %s | draw %s | write %s %.1fMB"
+					   " | alloc %lu | open %s load %ldms",
+					   tm[STAT_FRAME].count,
+					   statsFormatUs(p50, sizeof(p50), statsPercentile(&tm[STAT_FRAME], 0.5)),
+					   statsFormatUs(p99, sizeof(p99), statsPercentile(&tm[STAT_FRAME], 0.99)),
+					   E.stats.rows_rendered,
+					   statsFormatUs(render, sizeof(render), statsMeanUs(&tm[STAT_RENDER])),
+					   statsFormatUs(draw, sizeof(draw), statsMeanUs(&tm[STAT_DRAW])),
+					   statsFormatUs(wr, sizeof(wr), statsMeanUs(&tm[STAT_WRITE])),
+					   E.stats.bytes_written / 1048576.0,
+					   __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED),
+					   statsFormatUs(op, sizeof(op), statsMeanUs(&tm[STAT_OPEN])),
+					   E.indexed ? E.stats.load_ms : -1L);
+	if (len > E.screencols)
+		len = E.screencols;
+	abAppend(line, buf, len);
+}
+
+// 退出时把统计写成 JSON
+void statsDump()
+{
+	FILE *fp = fopen(E.stats.dump, "w");
+	if (fp == NULL)
+		return;
+	fprintf(fp, "{\"frames\":%lu,\"keys\":%lu,\"bytes_written\":%lu,\"writes\":%lu,"
+			"\"rows_rendered\":%lu,\"allocs\":%lu,\"first_frame_ms\":%ld,\"load_ms\":%ld,\"stages\":{",
+			E.stats.frames, E.stats.keys, E.stats.bytes_written, E.stats.writes,
+			E.stats.rows_rendered, __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED),
+			E.stats.first_frame_ms, E.stats.load_ms);
+	for (int i = 0; i < STAT_STAGES; i++)
+	{
+		statsTimer *t = &E.stats.timers[i];
+		fprintf(fp, "%s\"%s\":{\"count\":%lu,\"total_us\":%lu,\"max_us\":%lu,\"hist_us\":{",
+				i ? "," : "", statsStageName[i], t->count, t->total_ns / 1000, t->max_ns / 1000);
+		// 只写出非空的桶，键为桶的上界
+		bool first = true;
+		for (int b = 0; b < VEITOR_STATS_BUCKETS; b++)
+		{
+			if (t->hist[b] == 0)
+				continue;
+			fprintf(fp, "%s\"%lu\":%lu", first ? "" : ",", 1UL << b, t->hist[b]);
+			first = false;
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "}}\n");
+	fclose(fp);
+}
+
+#endif
+
+#pragma endregion
+
+/*** output ***/
+#pragma region
+
+void editorScroll()
+{
+	E.rx = E.cx;
+	int cw = 1;	// 光标所在字符的宽度，宽字符要完整显示在屏幕内
+	if (E.cy < editorVisibleRows())
+	{
+		erow *row = editorRowAt(editorFileRow(E.cy));
+		E.rx = editorRowCxToRx(row, E.cx);
+		if (!(row->flags & ROW_ASCII) && E.cx < row->size && (unsigned char)row->chars[E.cx] >= 0x80)
+		{
+			int len;
+			if (editorRowCharWidth(row, E.cx, &len) == 2)
+				cw = 2;
+		}
+	}
+
+	// 当文本纵坐标小于行偏移量时
+	if (E.cy < E.rowoff)
+	{
+		E.rowoff = E.cy;
+	}
+	// 当文本纵坐标大于行偏移量+终端行数时
+	if (E.cy >= E.rowoff + E.screenrows)
+	{
+		E.rowoff = E.cy - E.screenrows + 1;
+	}
+
+	if (E.rx < E.coloff)
+	{
+		E.coloff = E.rx;
+	}
+	if (E.rx + cw > E.coloff + E.screencols)
+	{
+		E.coloff = E.rx + cw - E.screencols;
+	}
+}
+
+// 将第 y 行与终端上的内容比较，只输出不同的部分
+void editorDrawLine(struct abuf *ab, int y, struct abuf *line, bool clear)
+{
+	struct abuf *old = &E.shadow[y];
+	// 空行的缓冲区可能还没有分配，不能交给 memcmp
+	if (E.shadowvalid && old->len == line->len &&
+		(line->len == 0 || memcmp(old->b, line->b, line->len) == 0))
+		return;
+
+	// 行首相同的属性序列（如状态栏的反色）不占列，从差异处输出时重新带上
+	int attr = 0;
+	if (E.shadowvalid && line->len > 2 && line->b[0] == '\x1b' && line->b[1] == '[')
+	{
+		while (attr < line->len && line->b[attr] != 'm')
+			attr++;
+		attr++;
+		if (attr > line->len || attr > old->len || memcmp(old->b, line->b, attr) != 0)
+			attr = 0;
+	}
+
+	// 相同的前缀都是可打印 ASCII 时，列数等于字节数，可以从第一个不同处开始输出
+	int pre = attr;
+	if (E.shadowvalid)
+	{
+		int n = old->len < line->len ? old->len : line->len;
+		while (pre < n && old->b[pre] == line->b[pre] &&
+			   old->b[pre] >= 0x20 && old->b[pre] < 0x7f)
+			pre++;
+		// 差异处新旧内容可能是组合符号，它们属于前一列，从前一个字符开始输出
+		if (pre > attr && ((pre < line->len && (unsigned char)line->b[pre] >= 0x80) ||
+						   (pre < old->len && (unsigned char)old->b[pre] >= 0x80)))
+			pre--;
+	}
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, pre - attr + 1);
+	abAppend(ab, buf, len);
+	abAppend(ab, line->b, attr);
+	abAppend(ab, &line->b[pre], line->len - pre);
+	// 清除当前行，清除刷新前的终端内容
+	if (clear)
+		abAppend(ab, "\x1b[K", 3);
+
+	old->len = 0;
+	abAppend(old, line->b, line->len);
+}
+
+void editorDrawRows(struct abuf *ab, struct abuf *line)
+{
+	int y;
+	for (y = 0; y < E.screenrows; y++)
+	{
+		line->len = 0;
+		int filerow = y + E.rowoff;
+		// 如果行偏移量大于文件内容行数，则不会显示默认文本
+		if (filerow >= editorVisibleRows())
 		{
 			// 如果没有读取文本，在1/3处打印软件名和版本号
 			if (E.numrows == 0 && y == E.screenrows / 3)
@@ -469,91 +5261,271 @@ void editorDrawRows(struct abuf *ab)
 					welcomelen = E.screencols;
 				int padding = (E.screencols - welcomelen) / 2;
 				if (padding--)
-					abAppend(ab, "~", 1);
-				while (padding--)
-					abAppend(ab, " ", 1);
-				abAppend(ab, welcome, welcomelen);
+					abAppend(line, "~", 1);
+				abAppendFill(line, ' ', padding);
+				abAppend(line, welcome, welcomelen);
 			}
 			else
 			{
-				abAppend(ab, "~", 1);
+				abAppend(line, "~", 1);
 			}
 		}
 		else
 		{
-			int len = E.row[filerow].rsize - E.coloff;
-			// 即列偏移量大于这行文本长度时
-			if (len < 0) len = 0;
-			if (len > E.screencols)	len = E.screencols;
-			abAppend(ab, &E.row[filerow].render[E.coloff], len);
+			erow *row = editorRenderRow(editorFileRow(filerow));
+			// 按显示列裁剪，render 中字节数不少于列数，放得下时不需要逐字计算
+			int start = 0, pad = 0, used;
+			if (E.coloff > 0)
+			{
+				start = widthSkip(row->render, row->rsize, E.coloff, &used);
+				// 被左边界截断的宽字符连同后面的零宽字符显示为一个空格
+				if (used < E.coloff && start < row->rsize)
+				{
+					start += widthSkip(&row->render[start], row->rsize - start, 2, &used);
+					pad = 1;
+				}
+			}
+			int len = row->rsize - start;
+			if (len > E.screencols - pad)
+				len = widthSkip(&row->render[start], len, E.screencols - pad, &used);
+			abAppendFill(line, ' ', pad);
+			if (row->hl == NULL)
+			{
+				abAppend(line, &row->render[start], len);
+			}
+			else
+			{
+				// 颜色变化时才输出转义序列，整段同色的文本一起追加
+				char *c = &row->render[start];
+				unsigned char *hl = &row->hl[start];
+				int color = 39;
+				int j = 0;
+				while (j < len)
+				{
+					int k = j;
+					while (k < len && hl[k] == hl[j])
+						k++;
+					int next = editorSyntaxToColor(hl[j]);
+					if (next != color)
+					{
+						char buf[16];
+						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", next);
+						abAppend(line, buf, clen);
+						color = next;
+					}
+					abAppend(line, &c[j], k - j);
+					j = k;
+				}
+				if (color != 39)
+					abAppend(line, "\x1b[39m", 5);
+			}
 		}
 
-		// 清除当前行，清除刷新前的终端内容
-		abAppend(ab, "\x1b[K", 3);
+		editorDrawLine(ab, y, line, true);
+	}
+}
+
+void editorDrawStatuBar(struct abuf *ab, struct abuf *line)
+{
+	line->len = 0;
+	abAppend(line, "\x1b[7m", 4);
+
+	char status[80], rstatus[80];
+	int len = snprintf(status, sizeof(status), "%.20s - %d lines%s%s%s",
+							E.filename ? E.filename : E.stream.bytes ? "[stdin]" : "[No Name]",
+							E.numrows,
+							E.viewmode ? " [view]" : "",
+							E.follow.active ? " [follow]" : "",
+							E.dirty ? " (modified)" : "");
+	if (E.filter.active && len < (int)sizeof(status))
+		len += snprintf(status + len, sizeof(status) - len, " [%d match \"%.10s\"]",
+						E.filter.nrows, E.filter.pattern);
+	// 后台加载中显示进度
+	if (!E.indexed && len < (int)sizeof(status))
+		len += snprintf(status + len, sizeof(status) - len, " loading %d%%",
+						(int)(__atomic_load_n(&E.loader.scanned, __ATOMIC_RELAXED) * 100 / E.mapsize));
+	if (len >= (int)sizeof(status))
+		len = sizeof(status) - 1;
+	int rlen;
+	if (E.search.query)
+		// 统计或加载未完成时显示已找到的数量
+		rlen = snprintf(rstatus, sizeof(rstatus), "%zu%s matches  %d,%d-%d",
+						__atomic_load_n(&E.search.count, __ATOMIC_RELAXED),
+						E.search.active || !E.indexed ? "+" : "", E.cy + 1, E.rx + 1, E.cx + 1);
+	else
+		rlen = snprintf(rstatus, sizeof(rstatus), "%d,%d-%d", editorFileRow(E.cy) + 1, E.rx + 1, E.cx + 1);
+	abAppend(line, status, len);
+	// 用空格填充，右侧位置足够时靠右显示光标位置
+	if (E.screencols - len >= rlen)
+	{
+		abAppendFill(line, ' ', E.screencols - len - rlen);
+		abAppend(line, rstatus, rlen);
+	}
+	else
+	{
+		abAppendFill(line, ' ', E.screencols - len);
+	}
+	abAppend(line, "\x1b[m", 3);
 
-		// 为文件文本添加换行符
-		abAppend(ab, "\r\n", 2);
+	// 状态栏占满整行，不需要清除
+	editorDrawLine(ab, E.screenrows, line, false);
+}
+
+void editorDrawMessageBar(struct abuf *ab, struct abuf *line)
+{
+	line->len = 0;
+#ifdef VEITOR_STATS
+	if (E.stats.overlay)
+	{
+		statsOverlay(line);
+		editorDrawLine(ab, E.screenrows + 1, line, true);
+		return;
 	}
+#endif
+	int msglen = strlen(E.statusmsg);
+	if (msglen > E.screencols) msglen = E.screencols;
+	if (msglen && time(NULL) - E.statusmsg_time < 5)
+		abAppend(line, E.statusmsg, msglen);
+
+	editorDrawLine(ab, E.screenrows + 1, line, true);
 }
 
-void editorDrawStatuBar(struct abuf*ab)
+// 输出一帧；基准测试时写入虚拟终端
+void editorTermWrite(const char *s, int len)
 {
-	abAppend(ab, "\x1b[7m", 4);
+#ifdef VEITOR_BENCH
+	benchTermWrite(s, len);
+#else
+	write(STDOUT_FILENO, s, len);
+#endif
+	E.stats.writes++;
+}
 
-	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-							E.filename ? E.filename : "[No Name]", E.numrows);
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%d,%d-%d", E.cy + 1, E.rx + 1, E.cx + 1);
-	abAppend(ab, status, len);
-	while (len < E.screencols)
+// 把屏幕副本的 [0, n) 行循环移动 k 行，k 为正时向上
+void editorRotateShadow(int n, int k)
+{
+	k = ((k % n) + n) % n;
+	struct abuf *a = E.shadow;
+	// 三次翻转完成循环移动
+	for (int r = 0; r < 3; r++)
 	{
-		if (E.screencols - len == rlen)
+		int lo = r == 0 ? 0 : r == 1 ? k : 0;
+		int hi = r == 0 ? k : n;
+		for (hi--; lo < hi; lo++, hi--)
 		{
-			abAppend(ab, rstatus, rlen);
-			break;
+			struct abuf t = a[lo];
+			a[lo] = a[hi];
+			a[hi] = t;
 		}
-		abAppend(ab, " ", 1);
-		len++;
 	}
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf* ab)
+// 文本区域滚动 delta 行：在状态栏以上的滚动区域中让终端滚动，
+// 副本随之移动，露出的行在终端上为空行，之后只需绘制这些行
+void editorScrollShadow(struct abuf *ab, int delta)
 {
-	// 清除当前行
-	abAppend(ab, "\x1b[K", 3);
-	int msglen = strlen(E.statusmsg);
-	if (msglen > E.screencols) msglen = E.screencols;
-	if (msglen && time(NULL) - E.statusmsg_time < 5)
-		abAppend(ab, E.statusmsg, msglen);
+	int n = delta > 0 ? delta : -delta;
+	char buf[48];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+					   E.screenrows, n, delta > 0 ? 'S' : 'T');
+	abAppend(ab, buf, len);
+
+	editorRotateShadow(E.screenrows, delta);
+	int from = delta > 0 ? E.screenrows - n : 0;
+	for (int i = from; i < from + n; i++)
+		E.shadow[i].len = 0;
+}
+
+// 让下一次刷新重绘整个屏幕
+void editorInvalidateScreen()
+{
+	E.shadowvalid = false;
 }
 
 // 编辑刷新后的界面
 void editorRefreshScreen()
 {
+	STATS_START(frame);
 	editorScroll();
+	E.frame++;
 
-	// 创建缓冲区
-	struct abuf ab = ABUF_INIT;
+	// 屏幕大小变化后重新分配副本
+	if (E.shadowrows != E.screenrows + 2)
+	{
+		for (int i = 0; i < E.shadowrows; i++)
+			abFree(&E.shadow[i]);
+		E.shadowrows = E.screenrows + 2;
+		E.shadow = realloc(E.shadow, sizeof(struct abuf) * E.shadowrows);
+		if (E.shadow == NULL)
+			die("realloc");
+		for (int i = 0; i < E.shadowrows; i++)
+			E.shadow[i] = (struct abuf)ABUF_INIT;
+		E.shadowvalid = false;
+	}
 
-	// 隐藏光标，移动到左上角
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
+	// 复用缓冲区，输出期间隐藏光标；支持时整帧放在同步更新中
+	struct abuf *ab = &E.outbuf;
+	ab->len = 0;
+	if (E.syncupdate)
+		abAppend(ab, "\x1b[?2026h", 8);
+	abAppend(ab, "\x1b[?25l", 6);
+	int head = ab->len;
 
-	editorDrawRows(&ab);	// 绘制波浪线或文本
-	editorDrawStatuBar(&ab);
-	editorDrawMessageBar(&ab);
+	if (!E.shadowvalid)
+		abAppend(ab, "\x1b[2J", 4);
+	// 只滚动了几行时先让终端滚动，未滚出屏幕的行不需要重新输出
+	int delta = E.rowoff - E.shadowrowoff;
+	if (E.shadowvalid && delta != 0 && delta > -E.screenrows && delta < E.screenrows)
+		editorScrollShadow(ab, delta);
+	E.shadowrowoff = E.rowoff;
 
-	// 移动光标，显示光标
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, 
-															(E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
-	abAppend(&ab, "\x1b[?25h", 6);
+	STATS_START(draw);
+	editorDrawRows(ab, &E.linebuf);	// 绘制波浪线或文本
+	STATS_STOP(STAT_DRAW, draw);
+	editorDrawStatuBar(ab, &E.linebuf);
+	editorDrawMessageBar(ab, &E.linebuf);
+
+	int cy = (E.cy - E.rowoff) + 1;
+	int cx = (E.rx - E.coloff) + 1;
+	bool drawn = ab->len > head;
+	// 没有行变化时不需要隐藏光标
+	if (!drawn)
+		ab->len = 0;
+	if (drawn || cy != E.shadowcy || cx != E.shadowcx)
+	{
+		// 移动光标
+		char buf[32];
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+		abAppend(ab, buf, strlen(buf));
+		E.shadowcy = cy;
+		E.shadowcx = cx;
+	}
+	if (drawn)
+	{
+		abAppend(ab, "\x1b[?25h", 6);
+		if (E.syncupdate)
+			abAppend(ab, "\x1b[?2026l", 8);
+	}
+	E.shadowvalid = true;
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	if (ab->len > 0)
+	{
+		STATS_START(w);
+		editorTermWrite(ab->b, ab->len);
+		STATS_STOP(STAT_WRITE, w);
+	}
+	E.stats.bytes_written += ab->len;
+	E.stats.frame_bytes = ab->len;
+	E.stats.frames++;
+
+	if (E.stats.first_frame_ms == -1 && E.numrows > 0)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		E.stats.first_frame_ms = (now.tv_sec - E.stats.open_start.tv_sec) * 1000 +
+								 (now.tv_nsec - E.stats.open_start.tv_nsec) / 1000000;
+	}
+	STATS_STOP(STAT_FRAME, frame);
 }
 
 void editorSetStatusMessage(char *fmt, ...)
@@ -570,35 +5542,86 @@ void editorSetStatusMessage(char *fmt, ...)
 /*** input ***/
 #pragma region
 
+// 在消息栏中读取一行输入，每次按键后调用 callback，ESC 取消时返回 NULL
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
+{
+	size_t bufsize = 128;
+	char *buf = malloc(bufsize);
+	if (buf == NULL)
+		die("malloc");
+	size_t buflen = 0;
+	buf[0] = '\0';
+
+	while (1)
+	{
+		// 等待按键期间后台线程的进度也要显示出来
+		while (E.keyqlen == 0)
+		{
+			editorSetStatusMessage(prompt, buf);
+			editorRefreshScreen();
+			editorWaitEvents();
+		}
+
+		int c = editorReadKey();
+		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+		{
+			if (buflen != 0)
+				buf[--buflen] = '\0';
+		}
+		else if (c == '\x1b')
+		{
+			editorSetStatusMessage("");
+			if (callback)
+				callback(buf, c);
+			free(buf);
+			return NULL;
+		}
+		else if (c == '\r')
+		{
+			if (buflen != 0)
+			{
+				editorSetStatusMessage("");
+				if (callback)
+					callback(buf, c);
+				return buf;
+			}
+		}
+		else if (c < ARROW_LEFT && (unsigned char)c >= ' ' && c != BACKSPACE)
+		{
+			if (buflen == bufsize - 1)
+			{
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+				if (buf == NULL)
+					die("realloc");
+			}
+			buf[buflen++] = c;
+			buf[buflen] = '\0';
+		}
+
+		if (callback)
+			callback(buf, c);
+	}
+}
+
 // 控制光标移动
 void editorMoveCursor(int key)
 {
+	E.undo.sealed = true;
 	// 判断下一行是否存在并获取本行
-	erow * row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;
+	erow * row = (E.cy < editorVisibleRows()) ? editorRowAt(editorFileRow(E.cy)) : NULL;
 
 	switch (key)
 	{
 	case ARROW_LEFT:
 		if (E.cx != 0)
 		{
-			if (is_continuation_byte(row->chars[E.cx - 1]) && !isalnum(row->chars[E.cx - 1])) 
-			{
-				// 如果前面一个字符是多字节字符的后续字节，继续向左移动，
-				while (E.cx > 0 && is_continuation_byte(row->chars[E.cx - 1])) 
-				{
-					E.cx--;
-				}
-				// 多字节字符的第一个
-				E.cx--;
-			} 
-			else 
-			{
-				E.cx--;
-			}
+			// 回到前一个字符的首字节，组合符号不单独停留
+			E.cx = editorRowPrevChar(row, E.cx);
 		}
 		else if (E.cy != 0)
 		{
-			row = &E.row[E.cy - 1];
+			row = editorRowAt(editorFileRow(E.cy - 1));
 			E.cy--;
 			E.cx = row->size;
 		}
@@ -606,8 +5629,7 @@ void editorMoveCursor(int key)
 	case ARROW_RIGHT:
 		if (row && E.cx < row->size)
 		{
-			// E.cx++;
-			E.cx += char_byte(row->chars[E.cx]);
+			E.cx = editorRowNextChar(row, E.cx);
 		}
 		else if (row && E.cx == row->size)
 		{
@@ -617,19 +5639,24 @@ void editorMoveCursor(int key)
 		break;
 	case ARROW_UP:
 		if (E.cy != 0)
+		{
 			E.cy--;
+			E.cx = editorRowRxToCx(editorRowAt(editorFileRow(E.cy)), E.rx);
+		}
 		break;
 	case ARROW_DOWN:
 		// 当文本坐标小于文本行数时
-		if (E.cy < E.numrows )
+		if (E.cy < editorVisibleRows())
 		{
 			E.cy++;
-			E.cx = E.rx;
+			// 保持光标所在的显示列
+			if (E.cy < editorVisibleRows())
+				E.cx = editorRowRxToCx(editorRowAt(editorFileRow(E.cy)), E.rx);
 		}
 		break;
 	}
 
-	row = (E.cy < E.numrows) ? &E.row[E.cy] : NULL;
+	row = (E.cy < editorVisibleRows()) ? editorRowAt(editorFileRow(E.cy)) : NULL;
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen)
 		E.cx = rowlen;
@@ -652,10 +5679,12 @@ void editorProcessKeypress()
 
 	case HOME_KEY:
 		E.cx = 0;
+		E.undo.sealed = true;
 		break;
 	case END_KEY:
-		if (E.cy < E.numrows)
-			E.cx = E.row[E.cy].size;
+		E.undo.sealed = true;
+		if (E.cy < editorVisibleRows())
+			E.cx = editorRowAt(editorFileRow(E.cy))->size;
 		break;
 
 	case PAGE_UP:
@@ -669,7 +5698,7 @@ void editorProcessKeypress()
 		else if (c == PAGE_DOWN)
 		{
 			E.cy = E.rowoff + E.screenrows - 1;
-			if (E.cy > E.numrows) E.cy = E.numrows;
+			if (E.cy > editorVisibleRows()) E.cy = editorVisibleRows();
 		}
 
 		int times = E.screenrows-1;
@@ -684,6 +5713,72 @@ void editorProcessKeypress()
 	case ARROW_RIGHT:
 		editorMoveCursor(c);
 		break;
+
+	case '\r':
+		editorFilterClear();
+		editorInsertNewline();
+		break;
+
+	case BACKSPACE:
+	case CTRL_KEY('h'):
+	case DEL_KEY:
+		// 编辑前退出过滤视图，行号会随编辑变化
+		editorFilterClear();
+		if (c == DEL_KEY)
+		{
+			// 移动光标不打断连续删除的合并
+			bool sealed = E.undo.sealed;
+			editorMoveCursor(ARROW_RIGHT);
+			E.undo.sealed = sealed;
+		}
+		editorDelChar();
+		break;
+
+	case CTRL_KEY('s'):
+		editorSave();
+		break;
+
+	case CTRL_KEY('f'):
+		editorFilterClear();
+		editorFind();
+		break;
+	case CTRL_KEY('g'):
+		editorFilter();
+		break;
+	case CTRL_KEY('t'):
+		if (E.follow.active)
+			editorFollowStop();
+		else
+			editorFollowStart();
+		break;
+
+	case CTRL_KEY('z'):
+		editorFilterClear();
+		editorUndo();
+		break;
+	case CTRL_KEY('y'):
+		editorFilterClear();
+		editorRedo();
+		break;
+
+#ifdef VEITOR_STATS
+	case CTRL_KEY('p'):
+		E.stats.overlay = !E.stats.overlay;
+		break;
+#endif
+
+	case CTRL_KEY('l'):
+	case '\x1b':
+		break;
+
+	default:
+		// 多字节字符按字节逐个插入
+		if (c == '\t' || (c < ARROW_LEFT && (unsigned char)c >= ' '))
+		{
+			editorFilterClear();
+			editorInsertChar(c);
+		}
+		break;
 	}
 }
 
@@ -702,9 +5797,59 @@ void initEditor()
 	E.coloff = 0;
 	E.numrows = 0;
 	E.row = NULL;
+	E.rowcap = 0;
+	E.rowarena.head = NULL;
+	E.rowarena.total = 0;
+	E.rcache = NULL;
+	E.rcachecap = 0;
+	E.rcachehead = E.rcachetail = E.rcachefree = -1;
+	E.rcachebytes = 0;
+	E.frame = 0;
+	E.shadow = NULL;
+	E.outbuf = (struct abuf)ABUF_INIT;
+	E.linebuf = (struct abuf)ABUF_INIT;
+	E.shadowrows = 0;
+	E.shadowvalid = false;
+	E.shadowcx = E.shadowcy = 0;
+	E.shadowrowoff = 0;
+	E.syncupdate = false;
+	memset(&E.stats, 0, sizeof(E.stats));
+	E.inlen = 0;
+	E.keyqhead = E.keyqlen = 0;
 	E.filename = NULL;
+	E.readonly = false;
+	E.dirty = 0;
+	E.pt = (pieceTable){false, NULL, 0, 0, -1, -1, 0, ABUF_INIT, NULL, 0, 0};
+	E.undo = (undoLog){{NULL, 0}, NULL, NULL, NULL, VEITOR_UNDO_MAX, true};
+	char *env = getenv("VEITOR_UNDO_MB");
+	if (env && atoi(env) > 0)
+		E.undo.cap = (size_t)atoi(env) << 20;
+	E.viewmode = false;
+	E.map = NULL;
+	E.mapsize = 0;
+	E.mapfd = -1;
+	E.lineblk = NULL;
+	E.lineblkcount = 0;
+	E.indexed = true;
+	E.loader.active = false;
+	E.search.active = false;
+	E.search.query = NULL;
+	E.filter = (rowFilter){false, NULL, NULL, 0, 0};
+	E.follow = (fileFollower){false, -1, -1, -1, 0, 0, 0, false, ABUF_INIT};
+	E.stream = (streamInput){-1, ABUF_INIT, 0, 0, 0};
+	E.syntax = NULL;
+	E.hlstate = NULL;
+	E.hlstatecap = 0;
+	E.hldirty = 0;
+	E.hlskip = -1;
+	E.rowcache = NULL;
+	E.rowcacheidx = NULL;
+	E.rowcachebuf = NULL;
+	E.rowcachesize = 0;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
+	scanInit();
+	poolInit(&E.pool);
 
 	if (getWindowSize(&(E.screenrows), &(E.screencols)) == -1)
 	{
@@ -712,25 +5857,653 @@ void initEditor()
 	}
 	
 	E.screenrows -= 2;
+
+	// 窗口大小变化和后台加载进度通过管道通知事件循环
+	if (pipe(E.winchpipe) == -1 || pipe(E.loader.notify) == -1 || pipe(E.search.notify) == -1)
+		die("pipe");
+	for (int i = 0; i < 2; i++)
+	{
+		fcntl(E.winchpipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(E.winchpipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(E.loader.notify[i], F_SETFL, O_NONBLOCK);
+		fcntl(E.loader.notify[i], F_SETFD, FD_CLOEXEC);
+		fcntl(E.search.notify[i], F_SETFL, O_NONBLOCK);
+		fcntl(E.search.notify[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editorHandleSigwinch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1)
+		die("sigaction");
+}
+
+// 重新读取窗口大小，下一帧整屏重绘
+void editorUpdateWindowSize()
+{
+	int rows, cols;
+	if (getWindowSize(&rows, &cols) == -1)
+		return;
+	E.screenrows = rows - 2;
+	E.screencols = cols;
+	if (E.screenrows < 1)
+		E.screenrows = 1;
+	editorResizeRowCache();
+	editorInvalidateScreen();
 }
 
+#ifndef VEITOR_BENCH
 int main(int argc, char *args[])
 {
+	// -v 强制以只读视图模式打开，禁止编辑；-f 跟随文件增长；
+	// 文件名为 - 时逐步读入标准输入，-n N 只保留最后 N 行；
+	// 编译时打开 VEITOR_STATS 后，-s FILE 在退出时写入统计
+	bool viewmode = false;
+	bool follow = false;
+	int keep = 0;
+	char *filename = NULL;
+	char *stats = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(args[i], "-v") == 0)
+			viewmode = true;
+		else if (strcmp(args[i], "-f") == 0)
+			follow = true;
+		else if (strcmp(args[i], "-n") == 0 && i + 1 < argc)
+			keep = atoi(args[++i]);
+#ifdef VEITOR_STATS
+		else if (strcmp(args[i], "-s") == 0 && i + 1 < argc)
+			stats = args[++i];
+#endif
+		else
+			filename = args[i];
+	}
+	// 键盘输入改从终端读取
+	int pipefd = -1;
+	if (filename && strcmp(filename, "-") == 0)
+	{
+		pipefd = editorStreamSwap();
+		filename = NULL;
+	}
+
 	enableRawMode();
 	initEditor();
-	// if (argc >= 2)
-		// editorOpen(args[1]);
-	editorOpen("../../src/Makefile");
+	editorTermQuery();
+	E.readonly = viewmode;
+#ifdef VEITOR_STATS
+	// -s 退出时把统计写入文件
+	E.stats.dump = stats;
+	if (stats)
+		atexit(statsDump);
+#else
+	(void)stats;
+#endif
+	if (filename)
+	{
+		STATS_START(t);
+		editorOpen(filename, viewmode);
+		STATS_STOP(STAT_OPEN, t);
+	}
+	if (pipefd != -1)
+		editorStreamStart(pipefd, keep);
+	if (follow)
+	{
+		editorFollowStart();
+		E.cy = editorVisibleRows() > 0 ? editorVisibleRows() - 1 : 0;
+	}
 
-	editorSetStatusMessage("HELP: Ctrl-Q = quit");
+	editorSetStatusMessage("HELP: ^S save | ^Q quit | ^F find | ^G filter | ^T follow | ^Z undo | ^Y redo"
+#ifdef VEITOR_STATS
+						   " | ^P stats"
+#endif
+						   );
 
 	while (1)
 	{
 		editorRefreshScreen();
+		editorWaitEvents();
+
+		// 输入积压时先处理完再刷新，只绘制最终状态
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (E.keyqlen > 0)
+		{
+			editorProcessKeypress();
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (E.keyqlen == 0 && editorInputReady() &&
+				(now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_nsec - start.tv_nsec) / 1000000 < VEITOR_MAX_SKIP_MS)
+				editorFillKeys();
+		}
+	}
+
+	return 0;
+}
+
+#endif
+
+#pragma endregion
+
+/*** bench ***/
+#pragma region
+#ifdef VEITOR_BENCH
+
+// 无终端运行编辑器核心，按脚本输入按键，每个场景输出一行 JSON
+
+int benchOut = -1;		// -o 指定时把输出写入文件，可在真实终端中回放
+
+void benchTermWrite(const char *s, int len)
+{
+	if (benchOut != -1 && write(benchOut, s, len) != len)
+		die("write");
+}
+
+// 一个场景的计数，开始时记录起点
+typedef struct benchRun
+{
+	const char *name;
+	double *frames;		// 每帧耗时（微秒）
+	int nframes, cap;
+	struct timespec start;
+	unsigned long bytes, writes, allocs, rwsyscalls;
+} benchRun;
+
+double benchNow()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+// 读取一次 /proc/self/io 本身产生的读调用次数，报告时扣除
+unsigned long benchSyscallsSelf;
+
+// 进程累计的 read/write 类系统调用次数（syscr + syscw），不含 poll、mmap、ioctl 等
+unsigned long benchSyscalls()
+{
+	FILE *fp = fopen("/proc/self/io", "r");
+	if (fp == NULL)
+		return 0;
+	char line[128];
+	unsigned long n = 0, v;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "syscr: %lu", &v) == 1 || sscanf(line, "syscw: %lu", &v) == 1)
+			n += v;
+	}
+	fclose(fp);
+	return n;
+}
+
+void benchBegin(benchRun *r, const char *name)
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &r->start);
+	r->bytes = E.stats.bytes_written;
+	r->writes = E.stats.writes;
+	r->allocs = __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED);
+	r->rwsyscalls = benchSyscalls();
+}
+
+void benchFrameDone(benchRun *r, double t0)
+{
+	if (r->nframes == r->cap)
+	{
+		r->cap = r->cap ? r->cap * 2 : 1024;
+		r->frames = realloc(r->frames, sizeof(double) * r->cap);
+		if (r->frames == NULL)
+			die("realloc");
+	}
+	r->frames[r->nframes++] = benchNow() - t0;
+}
+
+// 刷新一帧并计时
+void benchFrame(benchRun *r)
+{
+	double t0 = benchNow();
+	editorRefreshScreen();
+	benchFrameDone(r, t0);
+}
+
+// 正在按脚本输入的场景：提示框中的按键由 benchFeed 送入，每个按键各计一帧
+benchRun *benchCurrent;
+int *benchKeys;
+int benchNkeys, benchNext;
+double benchT0;			// 当前按键开始处理的时刻
+double benchWaitMs;		// 最近一次 WAIT 从上一个按键开始到后台工作结束的时间
+size_t benchWaitMatches;	// 此时的匹配数：过滤时是匹配的行数，否则是查找统计的总数
+#define BENCH_WAIT -1	// 脚本中的 WAIT：等后台加载和统计结束
+
+// 处理一个按键并刷新，计入同一帧
+void benchKey(benchRun *r, int key)
+{
+	benchT0 = benchNow();
+	E.keyq[(E.keyqhead + E.keyqlen) % VEITOR_KEYQ_SIZE] = key;
+	E.keyqlen++;
+	while (E.keyqlen > 0)
 		editorProcessKeypress();
+	editorRefreshScreen();
+	benchFrameDone(r, benchT0);
+}
+
+// 等待后台线程的通知，不读取终端
+void benchPump(int timeout)
+{
+	struct pollfd fds[2] = {
+		{E.loader.notify[0], POLLIN, 0},
+		{E.search.notify[0], POLLIN, 0},
+	};
+	if (poll(fds, 2, timeout) <= 0)
+		return;
+	if (fds[0].revents & POLLIN)
+		editorLoaderUpdate();
+	if (fds[1].revents & POLLIN)
+		editorSearchUpdate();
+}
+
+// 脚本的下一个按键，遇到 WAIT 时先等后台工作结束；脚本结束时返回 0
+int benchNextKey()
+{
+	while (benchNext < benchNkeys && benchKeys[benchNext] == BENCH_WAIT)
+	{
+		benchNext++;
+		while ((E.loader.active && !E.indexed) || E.search.active)
+			benchPump(100);
+		benchWaitMs = (benchNow() - benchT0) / 1e3;
+		benchWaitMatches = E.filter.active ? (size_t)E.filter.nrows : E.search.count;
+	}
+	return benchNext < benchNkeys ? benchKeys[benchNext++] : 0;
+}
+
+// 提示框等待输入：结束上一个按键的一帧，送入脚本的下一个按键
+bool benchFeed()
+{
+	if (benchCurrent == NULL)
+		return false;
+	benchFrameDone(benchCurrent, benchT0);
+	int key = benchNextKey();
+	if (key == 0)
+	{
+		fprintf(stderr, "script ended inside a prompt\n");
+		exit(1);
+	}
+	benchT0 = benchNow();
+	E.keyq[(E.keyqhead + E.keyqlen) % VEITOR_KEYQ_SIZE] = key;
+	E.keyqlen++;
+	return true;
+}
+
+// 依次处理 keys 中的按键
+void benchRunKeys(benchRun *r, int *keys, int n)
+{
+	benchCurrent = r;
+	benchKeys = keys;
+	benchNkeys = n;
+	benchNext = 0;
+	int key;
+	while ((key = benchNextKey()) != 0)
+		benchKey(r, key);
+	benchCurrent = NULL;
+	benchKeys = NULL;
+}
+
+int benchCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+double benchPercentile(benchRun *r, double p)
+{
+	if (r->nframes == 0)
+		return 0;
+	int i = (int)(p * (r->nframes - 1) + 0.5);
+	return r->frames[i];
+}
+
+void benchJsonString(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		if ((unsigned char)*s >= ' ')
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+// 输出一个场景的结果；extra 为附加的字段
+void benchReport(benchRun *r, const char *file, const char *extra)
+{
+	qsort(r->frames, r->nframes, sizeof(double), benchCompare);
+	double total = 0;
+	for (int i = 0; i < r->nframes; i++)
+		total += r->frames[i];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double wall = (now.tv_sec - r->start.tv_sec) * 1e3 + (now.tv_nsec - r->start.tv_nsec) / 1e6;
+
+	printf("{\"scenario\":");
+	benchJsonString(r->name);
+	printf(",\"file\":");
+	benchJsonString(file);
+	printf(",\"rows\":%d,\"cols\":%d,\"lines\":%d,\"frames\":%d,"
+		   "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"mean_us\":%.1f,"
+		   "\"wall_ms\":%.1f,\"bytes\":%lu,\"term_writes\":%lu,\"rw_syscalls\":%lu,\"allocs\":%lu%s}\n",
+		   E.screenrows + 2, E.screencols, E.numrows, r->nframes,
+		   benchPercentile(r, 0.5), benchPercentile(r, 0.9), benchPercentile(r, 0.99),
+		   benchPercentile(r, 1.0), r->nframes ? total / r->nframes : 0, wall,
+		   E.stats.bytes_written - r->bytes, E.stats.writes - r->writes,
+		   benchSyscalls() - r->rwsyscalls - benchSyscallsSelf,
+		   __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED) - r->allocs, extra ? extra : "");
+	fflush(stdout);
+	free(r->frames);
+}
+
+// 场景开始前回到文件开头并整屏重绘
+void benchReset()
+{
+	E.cx = E.cy = E.rowoff = E.coloff = 0;
+	editorInvalidateScreen();
+}
+
+// 打开文件：第一帧之后边加载边刷新，直到加载完成
+void benchOpen(const char *file, bool viewmode)
+{
+	benchRun r;
+	benchBegin(&r, "open");
+	editorOpen((char *)file, viewmode);
+	benchFrame(&r);
+	while (!E.indexed)
+	{
+		benchPump(100);
+		benchFrame(&r);
+	}
+	char extra[128];
+	snprintf(extra, sizeof(extra), ",\"first_frame_ms\":%ld,\"load_ms\":%ld,\"cached_rows\":%d",
+			 E.stats.first_frame_ms, E.indexed && E.viewmode ? E.stats.load_ms : 0L,
+			 E.icache.data ? E.icache.rows : 0);
+	benchReport(&r, file, extra);
+}
+
+// 稳定状态的重绘不分配内存：画过一遍之后交替整屏重绘和原样刷新，
+// 期间有任何分配就报告失败
+#define BENCH_REPAINT_FRAMES 1000
+bool benchRepaint(const char *file)
+{
+	benchRun r;
+	benchBegin(&r, "repaint");
+	benchReset();
+	editorRefreshScreen();
+	editorInvalidateScreen();
+	editorRefreshScreen();
+	// 计时数组先分配好，不计入
+	r.cap = BENCH_REPAINT_FRAMES;
+	r.frames = malloc(sizeof(double) * r.cap);
+	if (r.frames == NULL)
+		die("malloc");
+	unsigned long before = __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED);
+	r.allocs = before;
+	for (int i = 0; i < BENCH_REPAINT_FRAMES; i++)
+	{
+		if (i % 2 == 0)
+			editorInvalidateScreen();
+		benchFrame(&r);
+	}
+	unsigned long allocs = __atomic_load_n(&statsAllocs, __ATOMIC_RELAXED) - before;
+	benchReport(&r, file, NULL);
+	if (allocs != 0)
+	{
+		fprintf(stderr, "repaint: %lu allocations in %d steady-state frames\n",
+				allocs, BENCH_REPAINT_FRAMES);
+		return false;
+	}
+	return true;
+}
+
+// 从头到尾逐页向下翻
+void benchPageDown(const char *file)
+{
+	benchRun r;
+	benchBegin(&r, "pagedown");
+	benchReset();
+	benchFrame(&r);
+	int last = -1;
+	while (E.rowoff != last)
+	{
+		last = E.rowoff;
+		benchKey(&r, PAGE_DOWN);
+	}
+	benchReport(&r, file, NULL);
+}
+
+// 从头按住下方向键，最多 2 万行，每帧只滚动一行
+void benchHoldDown(const char *file)
+{
+	benchRun r;
+	benchBegin(&r, "down");
+	benchReset();
+	benchFrame(&r);
+	for (int i = 0; i < E.numrows && i < 20000; i++)
+		benchKey(&r, ARROW_DOWN);
+	benchReport(&r, file, NULL);
+}
+
+// 在前 10 万行中最长的一行上按住右方向键
+void benchHoldRight(const char *file)
+{
+	int longest = 0;
+	for (int i = 0; i < E.numrows && i < 100000; i++)
+	{
+		if (editorRowAt(i)->size > editorRowAt(longest)->size)
+			longest = i;
+	}
+	int size = E.numrows ? editorRowAt(longest)->size : 0;
+
+	benchRun r;
+	benchBegin(&r, "right");
+	benchReset();
+	E.cy = E.rowoff = longest;
+	benchFrame(&r);
+	for (int i = 0; i < size && i < 20000; i++)
+		benchKey(&r, ARROW_RIGHT);
+	char extra[48];
+	snprintf(extra, sizeof(extra), ",\"line\":%d,\"line_bytes\":%d", longest + 1, size);
+	benchReport(&r, file, extra);
+}
+
+// 按键脚本：逗号分隔，每项为按键名或 s:文本，可以加 *次数，例如 PGDN*10,s:abc,UP*3
+void benchScript(const char *file, const char *script)
+{
+	static const struct { const char *name; int key; } names[] = {
+		{"UP", ARROW_UP}, {"DOWN", ARROW_DOWN}, {"LEFT", ARROW_LEFT}, {"RIGHT", ARROW_RIGHT},
+		{"PGUP", PAGE_UP}, {"PGDN", PAGE_DOWN}, {"HOME", HOME_KEY}, {"END", END_KEY},
+		{"DEL", DEL_KEY}, {"BS", BACKSPACE}, {"ENTER", '\r'}, {"ESC", '\x1b'}, {"UNDO", CTRL_KEY('z')},
+		{"REDO", CTRL_KEY('y')}, {"FIND", CTRL_KEY('f')}, {"FILTER", CTRL_KEY('g')}, {"WAIT", BENCH_WAIT},
+	};
+	benchRun r;
+	benchBegin(&r, "script");
+	benchReset();
+	benchFrame(&r);
+
+	// 先把整个脚本展开成按键，提示框中的按键要在处理 FIND 或 FILTER 的过程中送入
+	struct abuf keys = ABUF_INIT;
+	char *copy = strdup(script);
+	if (copy == NULL)
+		die("strdup");
+	char *save = NULL;
+	for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		int count = 1;
+		char *star = strrchr(tok, '*');
+		if (star && star[1] != '\0' && strspn(star + 1, "0123456789") == strlen(star + 1))
+		{
+			*star = '\0';
+			count = atoi(star + 1);
+		}
+		for (int n = 0; n < count; n++)
+		{
+			if (strncmp(tok, "s:", 2) == 0)
+			{
+				for (char *c = tok + 2; *c; c++)
+				{
+					int key = (unsigned char)*c;
+					abAppend(&keys, (char *)&key, sizeof(int));
+				}
+				continue;
+			}
+			unsigned int j;
+			for (j = 0; j < sizeof(names) / sizeof(names[0]); j++)
+			{
+				if (strcmp(tok, names[j].name) == 0)
+				{
+					abAppend(&keys, (char *)&names[j].key, sizeof(int));
+					break;
+				}
+			}
+			if (j == sizeof(names) / sizeof(names[0]))
+			{
+				fprintf(stderr, "unknown key: %s\n", tok);
+				exit(1);
+			}
+		}
+	}
+	free(copy);
+	benchRunKeys(&r, (int *)keys.b, keys.len / sizeof(int));
+	abFree(&keys);
+	benchReport(&r, file, NULL);
+}
+
+// 查找或过滤：按 key 打开提示框，逐字输入 query，等后台工作结束后按 after 若干次，最后按 ESC。
+// 查找时 wait_ms 是输入最后一个字符后统计整个文档的时间
+#define BENCH_PROMPT_REPEAT 50
+void benchPrompt(const char *file, const char *name, int key, const char *query, int after)
+{
+	int n = strlen(query);
+	int *keys = malloc(sizeof(int) * (n + BENCH_PROMPT_REPEAT + 3));
+	if (keys == NULL)
+		die("malloc");
+	int k = 0;
+	keys[k++] = key;
+	for (int i = 0; i < n; i++)
+		keys[k++] = (unsigned char)query[i];
+	keys[k++] = BENCH_WAIT;
+	for (int i = 0; after && i < BENCH_PROMPT_REPEAT; i++)
+		keys[k++] = after;
+	keys[k++] = '\x1b';
+
+	benchRun r;
+	benchBegin(&r, name);
+	benchReset();
+	benchFrame(&r);
+	benchRunKeys(&r, keys, k);
+	free(keys);
+
+	char extra[256];
+	double gbps = benchWaitMs > 0 ? editorTextSize() / (benchWaitMs * 1e6) : 0;
+	int len = snprintf(extra, sizeof(extra), ",\"query_len\":%d,\"matches\":%zu,\"wait_ms\":%.1f", n,
+					   benchWaitMatches, benchWaitMs);
+	if (key == CTRL_KEY('f'))
+		snprintf(extra + len, sizeof(extra) - len, ",\"count_gbps\":%.2f", gbps);
+	benchReport(&r, file, extra);
+}
+
+// veitor_test 包含本文件，使用自己的 main
+#ifndef VEITOR_TEST
+int main(int argc, char *args[])
+{
+	int rows = 24, cols = 80;
+	bool viewmode = false;
+	const char *script = NULL;
+	const char *query = "error";
+	const char *file = NULL;
+	int first = argc;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(args[i], "-r") == 0 && i + 1 < argc)
+			rows = atoi(args[++i]);
+		else if (strcmp(args[i], "-c") == 0 && i + 1 < argc)
+			cols = atoi(args[++i]);
+		else if (strcmp(args[i], "-k") == 0 && i + 1 < argc)
+			script = args[++i];
+		else if (strcmp(args[i], "-q") == 0 && i + 1 < argc)
+			query = args[++i];
+		else if (strcmp(args[i], "-o") == 0 && i + 1 < argc)
+		{
+			benchOut = open(args[++i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (benchOut == -1)
+				die("open");
+		}
+		else if (strcmp(args[i], "-v") == 0)
+			viewmode = true;
+		else
+		{
+			file = args[i];
+			first = i + 1;
+			break;
+		}
+	}
+	if (file == NULL || rows < 3 || cols < 1)
+	{
+		fprintf(stderr, "usage: veitor_bench [-r rows] [-c cols] [-v] [-o out] [-k keys] [-q query] "
+				"file [open|pagedown|down|right|repaint|find|filter|script ...]\n"
+				"keys: comma-separated UP DOWN LEFT RIGHT PGUP PGDN HOME END DEL BS ENTER ESC UNDO REDO "
+				"FIND FILTER WAIT or s:text, each optionally followed by *count\n"
+				"each scenario prints one JSON line; rw_syscalls counts only read/write system calls "
+				"(syscr + syscw in /proc/self/io), not poll, mmap or ioctl\n");
+		return 1;
 	}
 
+	initEditor();
+	E.screenrows = rows - 2;
+	E.screencols = cols;
+	unsigned long self = benchSyscalls();
+	benchSyscallsSelf = benchSyscalls() - self;
+
+	// 没有指定场景时依次运行打开、翻页、按住下方向键和右方向键
+	if (first == argc)
+	{
+		benchOpen(file, viewmode);
+		benchPageDown(file);
+		benchHoldDown(file);
+		benchHoldRight(file);
+		if (script)
+			benchScript(file, script);
+		return 0;
+	}
+	benchOpen(file, viewmode);
+	for (int i = first; i < argc; i++)
+	{
+		if (strcmp(args[i], "pagedown") == 0)
+			benchPageDown(file);
+		else if (strcmp(args[i], "right") == 0)
+			benchHoldRight(file);
+		else if (strcmp(args[i], "down") == 0)
+			benchHoldDown(file);
+		else if (strcmp(args[i], "repaint") == 0)
+		{
+			if (!benchRepaint(file))
+				return 1;
+		}
+		else if (strcmp(args[i], "find") == 0)
+			benchPrompt(file, "find", CTRL_KEY('f'), query, ARROW_DOWN);
+		else if (strcmp(args[i], "filter") == 0)
+			benchPrompt(file, "filter", CTRL_KEY('g'), query, 0);
+		else if (strcmp(args[i], "script") == 0 && script)
+			benchScript(file, script);
+		else if (strcmp(args[i], "open") != 0)
+		{
+			fprintf(stderr, "unknown scenario: %s\n", args[i]);
+			return 1;
+		}
+	}
 	return 0;
 }
+#endif
 
-#pragma endregion
\ No newline at end of file
+#endif
+#pragma endregion
@@ -0,0 +1,1062 @@
+// 单元测试：直接包含编辑器源码以调用内部函数
+// 用法：veitor_test [scan|loader|piecetable|syntax|rows|arena|follow|cache|find|filter ...]，不带参数时运行全部测试
+#include "vorpal.c"
+
+/*** test ***/
+#pragma region
+
+// 固定种子的伪随机数，失败时可以按种子复现
+uint64_t testState;
+
+uint32_t testRand()
+{
+	testState ^= testState << 13;
+	testState ^= testState >> 7;
+	testState ^= testState << 17;
+	return testState >> 32;
+}
+
+int testFailures;
+
+void testFail(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	testFailures++;
+}
+
+// 随机文本：ASCII、tab、换行、多字节字符，以及不完整的序列和多余的后续字节
+void testFill(char *s, int n)
+{
+	static const char *pieces[] = {
+		"a", "Z", " ", "~", "\t", "\n", "\r", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80",
+		"\xcc\x81", "\xe2\x80\x8b", "\x80", "\xbf", "\xe4\xb8", "\xf0\x9f", "\xff", "\xc0"};
+	int count = sizeof(pieces) / sizeof(pieces[0]);
+	int i = 0;
+	while (i < n)
+	{
+		// 常有较长的纯 ASCII 段，让 SIMD 走整块的快速路径
+		if (testRand() % 3 == 0)
+		{
+			int run = testRand() % 80;
+			while (run-- > 0 && i < n)
+				s[i++] = 'a' + testRand() % 26;
+			continue;
+		}
+		const char *p = pieces[testRand() % count];
+		for (; *p && i < n; p++)
+			s[i++] = *p;
+	}
+}
+
+// 一组扫描实现
+typedef struct testKernels
+{
+	const char *name;
+	int (*columns)(const char *s, int n, int limit, int rx);
+	int (*classify)(const char *s, int n);
+	int (*counttabs)(const char *s, int n);
+	const char *(*find)(const char *s, size_t n, const char *p, size_t m);
+} testKernels;
+
+// SIMD 实现与标量实现逐一比较；缓冲区开头随机错开，末尾紧贴分配的边界，
+// 越界读取会被 ASan 发现
+void testScanKernels(const testKernels *k)
+{
+	const testKernels *ref = &(testKernels){"scalar", scanColumnsScalar, scanClassifyScalar,
+											scanCountTabsScalar, scanFindScalar};
+	for (int iter = 0; iter < 20000; iter++)
+	{
+		int head = testRand() % 64;
+		int n = testRand() % 320;
+		char *buf = malloc(head + n + 1);
+		if (buf == NULL)
+			die("malloc");
+		char *s = buf + head;
+		testFill(s, n);
+		if (testRand() % 8 == 0)
+			memset(s, 'x', n);
+
+		// 从中间截取的一段，解码可以读到缓冲区末尾
+		int cut = n ? testRand() % (n + 1) : 0;
+		int rx = testRand() % 20;
+		int a = ref->columns(s, cut, n, rx), b = k->columns(s, cut, n, rx);
+		if (a != b)
+			testFail("%s columns: iter %d n %d cut %d rx %d: %d != %d", k->name, iter, n, cut, rx, b, a);
+		a = ref->classify(s, n), b = k->classify(s, n);
+		if (a != b)
+			testFail("%s classify: iter %d n %d: %d != %d", k->name, iter, n, b, a);
+		a = ref->counttabs(s, n), b = k->counttabs(s, n);
+		if (a != b)
+			testFail("%s counttabs: iter %d n %d: %d != %d", k->name, iter, n, b, a);
+
+		// 模式一半取自文本本身，一半随机生成
+		char pat[16];
+		int m = 1 + testRand() % 12;
+		if (n >= m && testRand() % 2)
+			memcpy(pat, s + testRand() % (n - m + 1), m);
+		else
+			testFill(pat, m);
+		const char *x = ref->find(s, n, pat, m), *y = k->find(s, n, pat, m);
+		if (x != y)
+			testFail("%s find: iter %d n %d m %d: %ld != %ld", k->name, iter, n, m,
+					 y ? (long)(y - s) : -1L, x ? (long)(x - s) : -1L);
+		free(buf);
+	}
+}
+
+// 行索引：分成多个任务扫描时与逐字节查找换行的结果一致
+void testLineIndex()
+{
+	for (int iter = 0; iter < 40; iter++)
+	{
+		// 一部分缓冲区大于 VEITOR_INDEX_CHUNK 的数倍，会拆成多个任务
+		size_t n = iter % 4 == 0 ? (3 << 20) + testRand() % 4096 : testRand() % 20000;
+		int density = 1 + testRand() % 200;
+		char *buf = malloc(n + 1);
+		if (buf == NULL)
+			die("malloc");
+		for (size_t i = 0; i < n; i++)
+			buf[i] = testRand() % density == 0 ? '\n' : 'a';
+		size_t from = n ? testRand() % (n + 1) : 0;
+		size_t to = from + (n - from ? testRand() % (n - from + 1) : 0);
+		bool at_end = testRand() % 2;
+
+		size_t *off = NULL;
+		int cnt = 0, cap = 0;
+		lineIndexScan(buf, from, to, at_end, &off, &cnt, &cap);
+
+		int k = 0;
+		bool ok = off[0] == from;
+		for (size_t i = from; ok && i < to; i++)
+		{
+			if (buf[i] == '\n')
+				ok = ++k <= cnt && off[k] == i + 1;
+		}
+		if (ok && at_end && off[k] < to)
+			ok = ++k <= cnt && off[k] == to;
+		if (!ok || k != cnt)
+			testFail("lineIndexScan: iter %d n %zu [%zu, %zu) at_end %d: %d lines, expected %d",
+					 iter, n, from, to, at_end, cnt, k);
+		free(off);
+		free(buf);
+	}
+}
+
+// 临时文件：先留出 hole 字节的空洞（读出为 0，没有换行），再写入 tail；suffix 决定语法
+char *testTempFile(size_t hole, const char *tail, size_t len, const char *suffix)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path = malloc(PATH_MAX);
+	if (path == NULL)
+		die("malloc");
+	snprintf(path, PATH_MAX, "%s/veitor_test.XXXXXX%s", dir && dir[0] ? dir : "/tmp", suffix);
+	int fd = mkstemps(path, strlen(suffix));
+	if (fd == -1 || ftruncate(fd, hole) == -1 || pwrite(fd, tail, len, hole) != (ssize_t)len)
+		die("testTempFile");
+	close(fd);
+	return path;
+}
+
+// 等后台索引完成后与逐字节查找换行的结果比较
+void testLoaderVerify(const char *what)
+{
+	editorLoaderWait();
+	size_t off = 0;
+	int k = 0;
+	while (off < E.mapsize)
+	{
+		if (k > E.numrows || editorLineOffset(k) != off)
+		{
+			testFail("loader %s: row %d starts at %zu, expected %zu", what, k,
+					 k > E.numrows ? 0 : editorLineOffset(k), off);
+			return;
+		}
+		const char *nl = memchr(E.map + off, '\n', E.mapsize - off);
+		off = nl ? (size_t)(nl - E.map) + 1 : E.mapsize;
+		k++;
+	}
+	if (k != E.numrows || editorLineOffset(k) != E.mapsize)
+		testFail("loader %s: %d rows, expected %d", what, E.numrows, k);
+}
+
+// 以视图模式打开 path 并检查行索引
+void testLoaderCheck(const char *what, const char *path)
+{
+	editorOpen((char *)path, true);
+	testLoaderVerify(what);
+}
+
+// 后台加载：行长超过 VEITOR_LOAD_SEGMENT 且不在文件末尾时也能完成
+void testLoader()
+{
+	char *path = testTempFile(VEITOR_LOAD_SEGMENT + (16 << 20), "\nsecond\nthird", 14, "");
+	testLoaderCheck("long line", path);
+	unlink(path);
+	free(path);
+
+	for (int iter = 0; iter < 20; iter++)
+	{
+		size_t n = 1 + testRand() % (1 << 20);
+		int density = 1 + testRand() % 500;
+		char *buf = malloc(n);
+		if (buf == NULL)
+			die("malloc");
+		for (size_t i = 0; i < n; i++)
+			buf[i] = testRand() % density == 0 ? '\n' : 'a';
+		path = testTempFile(0, buf, n, "");
+		testLoaderCheck("random", path);
+		unlink(path);
+		free(path);
+		free(buf);
+	}
+	editorFreeRows();
+}
+
+// 等加载线程写完缓存后回收
+void testLoaderFinish()
+{
+	while (E.loader.active)
+	{
+		struct pollfd fd = {E.loader.notify[0], POLLIN, 0};
+		poll(&fd, 1, -1);
+		editorLoaderUpdate();
+	}
+}
+
+// 打开 path 并检查行索引；hit 表示缓存文件应当通过检查
+void testCacheStep(const char *what, const char *path, bool hit)
+{
+	editorOpen((char *)path, true);
+	bool used = E.icache.map != NULL;
+	if (used != hit)
+		testFail("cache %s: index cache %s, expected it %s", what, used ? "used" : "ignored",
+				 hit ? "used" : "ignored");
+	testLoaderVerify(what);
+	testLoaderFinish();
+}
+
+// 向文件末尾追加 n 行
+void testAppendLines(const char *path, const char *prefix, int n)
+{
+	FILE *fp = fopen(path, "a");
+	if (fp == NULL)
+		die("fopen");
+	for (int i = 0; i < n; i++)
+		fprintf(fp, "%s %d\n", prefix, i);
+	fclose(fp);
+}
+
+// 改写缓存文件中 at 处的 n 个字节，at 为负数时从末尾算起
+void testCacheCorrupt(const char *idx, long at, int c, int n)
+{
+	int fd = open(idx, O_RDWR);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+		die("testCacheCorrupt");
+	char buf[16];
+	memset(buf, c, n);
+	if (pwrite(fd, buf, n, at < 0 ? st.st_size + at : at) != n)
+		die("pwrite");
+	close(fd);
+}
+
+// 行索引缓存：重新打开时使用，文件变化后按规则失效，损坏时重新扫描，结果都与逐字节查找一致
+void testCache()
+{
+	char dir[] = "/tmp/veitor_cache.XXXXXX";
+	if (mkdtemp(dir) == NULL)
+		die("mkdtemp");
+	setenv("XDG_CACHE_HOME", dir, 1);
+	setenv("VEITOR_CACHE", "1", 1);
+
+	// 开头的空洞是一个没有换行的长行，之后是短行
+	char *path = testTempFile(VEITOR_CACHE_MIN, "", 0, "");
+	testAppendLines(path, "line", 20000);
+	char *real = realpath(path, NULL);
+	char *idx = cachePath(real);
+
+	testCacheStep("first open", path, false);
+	if (access(idx, F_OK) != 0)
+		testFail("cache: %s was not written", idx);
+	testCacheStep("reopen", path, true);
+	if (E.icache.data == NULL)
+		testFail("cache reopen: cached rows were not decoded");
+
+	testAppendLines(path, "appended", 500);
+	testCacheStep("append", path, true);
+
+	// 大小不变而修改时间不同
+	struct timespec times[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+	if (utimensat(AT_FDCWD, path, times, 0) == -1)
+		die("utimensat");
+	testCacheStep("touch", path, false);
+
+	// 已缓存部分的末尾被改写后又追加
+	struct stat st;
+	stat(path, &st);
+	int fd = open(path, O_WRONLY);
+	if (fd == -1 || pwrite(fd, "\n", 1, st.st_size - 3) != 1)
+		die("pwrite");
+	close(fd);
+	testAppendLines(path, "more", 10);
+	testCacheStep("rewrite and append", path, false);
+
+	// 截断后末尾是没有换行的一行，不写入缓存；补上换行后缓存仍然有效
+	stat(path, &st);
+	if (truncate(path, st.st_size - 1000) == -1)
+		die("truncate");
+	testCacheStep("truncate", path, false);
+	testAppendLines(path, "tail", 1);
+	testCacheStep("partial line", path, true);
+
+	// 同名的新文件
+	stat(path, &st);
+	char *copy = testTempFile(VEITOR_CACHE_MIN, "", 0, "");
+	if (truncate(copy, st.st_size) == -1 || rename(copy, path) == -1)
+		die("rename");
+	free(copy);
+	testAppendLines(path, "replaced", 100);
+	testCacheStep("replaced", path, false);
+
+	// 变长编码不完整或长度为 0 时停在最后一个有效的行
+	testCacheCorrupt(idx, -4, 0x80, 4);
+	testCacheStep("unterminated varint", path, true);
+	testCacheStep("rewritten", path, true);
+	if (E.icache.data == NULL)
+		testFail("cache rewritten: cached rows were not decoded");
+	testCacheCorrupt(idx, sizeof(indexCacheHeader) + strlen(real) + 50, 0, 8);
+	testCacheStep("zero length", path, true);
+	testCacheCorrupt(idx, 0, 'x', 4);
+	testCacheStep("bad header", path, false);
+
+	editorFreeRows();
+	setenv("VEITOR_CACHE", "0", 1);
+	unlink(idx);
+	snprintf(idx, strlen(idx) + 1, "%s/veitor", dir);
+	rmdir(idx);
+	rmdir(dir);
+	unlink(path);
+	free(idx);
+	free(real);
+	free(path);
+}
+
+// 片段表的参照模型：整个文本是一个字节数组，每次编辑后保存一份，撤销和重做在其中移动
+typedef struct testModel
+{
+	char **text;
+	size_t *len;
+	int cur, count, cap;
+} testModel;
+
+void testModelPush(testModel *m, const char *s, size_t len)
+{
+	for (int i = m->cur + 1; i < m->count; i++)
+		free(m->text[i]);
+	m->count = m->cur + 1;
+	if (m->count == m->cap)
+	{
+		m->cap = m->cap ? m->cap * 2 : 64;
+		m->text = realloc(m->text, sizeof(char *) * m->cap);
+		m->len = realloc(m->len, sizeof(size_t) * m->cap);
+		if (m->text == NULL || m->len == NULL)
+			die("realloc");
+	}
+	m->text[m->count] = malloc(len + 1);
+	if (m->text[m->count] == NULL)
+		die("malloc");
+	memcpy(m->text[m->count], s, len);
+	m->len[m->count] = len;
+	m->cur = m->count++;
+}
+
+void testModelFree(testModel *m)
+{
+	for (int i = 0; i < m->count; i++)
+		free(m->text[i]);
+	free(m->text);
+	free(m->len);
+}
+
+// 片段表的内容、行数、行起始偏移和生成的行都与模型一致
+bool testPieceCheck(const char *what, int seed, int step, const char *ref, size_t len)
+{
+	size_t total = ptTotal();
+	char *buf = malloc(total + 1);
+	if (buf == NULL)
+		die("malloc");
+	ptCopy(E.pt.root, 0, total, buf);
+	bool ok = total == len && memcmp(buf, ref, len) == 0;
+	free(buf);
+
+	size_t start = 0;
+	int k = 0;
+	for (size_t i = 0; ok && i < len; i++)
+	{
+		if (ref[i] != '\n')
+			continue;
+		erow *row = editorRowAt(k);
+		ok = ptLineStart(k) == start && (size_t)row->size == i - start &&
+			 memcmp(row->chars, ref + start, row->size) == 0;
+		start = i + 1;
+		k++;
+	}
+	ok = ok && E.numrows == k && ptLines() == k;
+	if (!ok)
+		testFail("piecetable %s: seed %d step %d: text differs from the model", what, seed, step);
+	return ok;
+}
+
+// 随机的插入、删除、撤销、重做和保存，与参照模型逐步比较；最后全部撤销后回到原文
+void testPieceRun(int seed, bool view)
+{
+	testState = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)seed << 1 | view);
+	static const char *pieces[] = {"a", "bc", "\n", "\t", "\xe4\xb8\xad", "/*", "*/", "\"", " "};
+	int npieces = sizeof(pieces) / sizeof(pieces[0]);
+
+	size_t n = testRand() % 3000;
+	char *text = malloc(n + 64);
+	if (text == NULL)
+		die("malloc");
+	size_t len = 0;
+	while (len < n)
+		for (const char *p = pieces[testRand() % npieces]; *p; p++)
+			text[len++] = *p;
+	char *path = testTempFile(0, text, len, testRand() % 2 ? ".c" : ".txt");
+	// 原始文本中每行都以换行结尾，最后一行没有时补上
+	if (len > 0 && text[len - 1] != '\n')
+		text[len++] = '\n';
+
+	testModel m = {NULL, NULL, -1, 0, 0};
+	testModelPush(&m, text, len);
+	editorOpen(path, view);
+	editorLoaderWait();
+	if (!editorBeginEdit())
+	{
+		testFail("piecetable: seed %d: editorBeginEdit failed", seed);
+		return;
+	}
+	const char *what = view ? "view" : "owned";
+	bool ok = testPieceCheck(what, seed, 0, text, len);
+
+	char *ref = malloc(1);
+	for (int step = 1; ok && step <= 300; step++)
+	{
+		size_t cur = m.len[m.cur];
+		ref = realloc(ref, cur + 64);
+		if (ref == NULL)
+			die("realloc");
+		memcpy(ref, m.text[m.cur], cur);
+		int op = testRand() % 10;
+		// 每次编辑单独成为一条撤销记录
+		E.undo.sealed = true;
+		if (op < 4 || cur == 0)
+		{
+			// 插入位置在最后的换行之前，文本为空时插入的内容以换行结尾
+			char s[32];
+			int slen = 0;
+			for (int j = 1 + testRand() % 4; j > 0; j--)
+				for (const char *p = pieces[testRand() % npieces]; *p; p++)
+					s[slen++] = *p;
+			if (cur == 0)
+				s[slen++] = '\n';
+			size_t off = cur ? testRand() % cur : 0;
+			int oldrows = E.numrows;
+			editorInsert(off, s, slen);
+			editorEndEdit(ptLineAt(off), oldrows);
+			memmove(ref + off + slen, ref + off, cur - off);
+			memcpy(ref + off, s, slen);
+			testModelPush(&m, ref, cur + slen);
+		}
+		else if (op < 7)
+		{
+			// 最后的换行不删除，文本只剩它时整个删除
+			size_t off = cur > 1 ? testRand() % (cur - 1) : 0;
+			size_t del = 1 + testRand() % 40;
+			if (cur == 1)
+				del = 1;
+			else if (off + del > cur - 1)
+				del = cur - 1 - off;
+			int oldrows = E.numrows;
+			editorDelete(off, del);
+			editorEndEdit(ptLineAt(off), oldrows);
+			memmove(ref + off, ref + off + del, cur - off - del);
+			testModelPush(&m, ref, cur - del);
+		}
+		else if (op < 8)
+		{
+			if (m.cur > 0)
+			{
+				editorUndo();
+				m.cur--;
+			}
+		}
+		else if (op < 9)
+		{
+			if (m.cur + 1 < m.count)
+			{
+				editorRedo();
+				m.cur++;
+			}
+		}
+		else
+		{
+			// 保存后读回文件，与模型比较
+			editorSave();
+			FILE *fp = fopen(path, "r");
+			char *saved = malloc(m.len[m.cur] + 2);
+			size_t got = fp && saved ? fread(saved, 1, m.len[m.cur] + 1, fp) : 0;
+			if (fp)
+				fclose(fp);
+			if (got != m.len[m.cur] || memcmp(saved, m.text[m.cur], got) != 0)
+			{
+				testFail("piecetable %s: seed %d step %d: saved file differs from the model", what, seed, step);
+				ok = false;
+			}
+			free(saved);
+		}
+		// 光标放在随机位置刷新一帧，生成 render 和高亮
+		E.cy = E.numrows ? testRand() % E.numrows : 0;
+		E.cx = 0;
+		editorRefreshScreen();
+		ok = ok && testPieceCheck(what, seed, step, m.text[m.cur], m.len[m.cur]);
+	}
+
+	while (ok && E.undo.top)
+		editorUndo();
+	if (ok && !testPieceCheck(what, seed, -1, text, len))
+		testFail("piecetable %s: seed %d: undoing everything did not restore the original", what, seed);
+
+	free(ref);
+	free(text);
+	testModelFree(&m);
+	editorFreeRows();
+	unlink(path);
+	free(path);
+}
+
+void testPieceTable()
+{
+	for (int seed = 0; seed < 60; seed++)
+	{
+		testPieceRun(seed, false);
+		testPieceRun(seed, true);
+	}
+}
+
+// 高亮：向后跳转跳过的行，滚动回来显示时按正确的起始状态补算
+void testSyntax()
+{
+	// 第 0 行开始的块注释到第 30000 行结束，之后是代码
+	struct abuf text = ABUF_INIT;
+	for (int i = 0; i < 150000; i++)
+	{
+		const char *line = i == 0 ? "/* start\n" : i == 30000 ? "end */\n" : "x = 1;\n";
+		abAppend(&text, line, strlen(line));
+	}
+	char *path = testTempFile(0, text.b, text.len, ".c");
+	abFree(&text);
+	editorOpen(path, false);
+
+	struct { int row; int hl; } checks[] = {
+		{120000, HL_NORMAL}, {20000, HL_MLCOMMENT}, {29999, HL_MLCOMMENT}, {90000, HL_NORMAL}, {60000, HL_NORMAL},
+	};
+	for (unsigned int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		// 先跳到远处，再回到前面的行
+		erow *row = editorRenderRow(checks[i].row);
+		if (row->rsize == 0 || row->hl[0] != checks[i].hl)
+			testFail("syntax: row %d highlighted as %d, expected %d", checks[i].row,
+					 row->rsize ? row->hl[0] : -1, checks[i].hl);
+	}
+	editorFreeRows();
+	unlink(path);
+	free(path);
+}
+
+// 由一段文本生成一行，分类并生成 render
+erow testRowNew(const char *s, int len)
+{
+	erow row = {0};
+	row.rcslot = -1;
+	row.chars = malloc(len + 1);
+	memcpy(row.chars, s, len);
+	row.chars[len] = '\0';
+	row.size = len;
+	editorRowClassify(&row);
+	editorUpdateRow(&row);
+	return row;
+}
+
+void testRowFree(erow *row)
+{
+	free(row->colidx);
+	if (!(row->flags & ROW_ALIAS))
+		free(row->render);
+	free(row->chars);
+}
+
+// 检查一行的列计算：光标位置与显示列来回换算不漂移，最后一列与 render 的宽度一致；
+// render 中没有不合法的序列
+void testRowCheck(const char *what, const char *s, int len)
+{
+	erow row = testRowNew(s, len);
+	int width = scanColumnsScalar(row.render, row.rsize, row.rsize, 0);
+	if (editorRowCxToRx(&row, len) != width)
+		testFail("rows: %s (%d bytes) ends at column %d, render is %d columns wide", what, len,
+				 editorRowCxToRx(&row, len), width);
+	for (int i = 0; i < row.rsize;)
+	{
+		uint32_t cp;
+		int n = utf8Decode(&row.render[i], row.rsize - i, &cp);
+		if (n == 1 && (unsigned char)row.render[i] >= 0x80)
+		{
+			testFail("rows: %s renders invalid byte 0x%02x at %d", what, (unsigned char)row.render[i], i);
+			break;
+		}
+		i += n;
+	}
+
+	// 长行每次换算都要扫描一段，只抽查部分位置
+	int stride = len >= VEITOR_COLIDX_MIN ? 97 : 1;
+	int last = 0;
+	for (int cx = 0, k = 0; cx < len; cx = editorRowNextChar(&row, cx), k++)
+	{
+		if (k % stride)
+			continue;
+		int rx = editorRowCxToRx(&row, cx);
+		int back = editorRowRxToCx(&row, rx);
+		// 零宽字符与前面的字符共用一列，换算回来只要求列相同
+		if (rx < last || editorRowCxToRx(&row, back) != rx)
+		{
+			testFail("rows: %s cursor at byte %d is column %d, which maps back to byte %d", what, cx, rx, back);
+			break;
+		}
+		if (editorRowPrevChar(&row, editorRowNextChar(&row, cx)) != cx)
+		{
+			testFail("rows: %s stepping forward and back from byte %d does not return to it", what, cx);
+			break;
+		}
+		last = rx;
+	}
+	testRowFree(&row);
+}
+
+// 行的显示列：按字符宽度，不合法的字节各占一列
+void testRows()
+{
+	static const char *valid[] = {"a", " ", "\t", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80", "\xcc\x81"};
+	// 多余的后续字节不能让光标和显示错开
+	const char *stray = "\xe4\xb8x\x80y\xbf";
+	testRowCheck("stray bytes", stray, strlen(stray));
+
+	// 只有被拒绝的字节显示为 '?'，旁边合法的宽字符仍占两列
+	const char *cut = "\xb8\xad\xe4\xb8\xad\x80\t\xe4\xb8";
+	erow row = testRowNew(cut, strlen(cut));
+	const char *render = "??\xe4\xb8\xad?   ??";
+	// 宽字符中间的字节不是光标位置，记为 -1
+	int cols[] = {0, 1, 2, -1, -1, 4, 5, 8, 9, 10};
+	if (row.rsize != (int)strlen(render) || memcmp(row.render, render, row.rsize) != 0)
+		testFail("rows: cut characters render as \"%.*s\"", row.rsize, row.render);
+	for (int cx = 0; cx <= row.size; cx++)
+		if (cols[cx] != -1 && editorRowCxToRx(&row, cx) != cols[cx])
+			testFail("rows: cut characters, byte %d at column %d, expected %d", cx, editorRowCxToRx(&row, cx), cols[cx]);
+	if (editorRowNextChar(&row, 2) != 5 || editorRowPrevChar(&row, 5) != 2 || editorRowPrevChar(&row, 2) != 1)
+		testFail("rows: cut characters, cursor does not step over the wide character as one");
+	testRowFree(&row);
+	for (int i = 0; i < 400; i++)
+	{
+		// 每隔几行用一个超过 VEITOR_COLIDX_MIN 的长行，经过列索引
+		int len = i % 50 == 0 ? VEITOR_COLIDX_MIN + testRand() % 4096 : testRand() % 300;
+		char *s = malloc(len + 4);
+		if (i % 2)
+		{
+			testFill(s, len);
+			for (int j = 0; j < len; j++)
+				if (s[j] == '\n')
+					s[j] = ' ';
+		}
+		else
+		{
+			int j = 0;
+			while (j < len)
+			{
+				const char *p = valid[testRand() % (sizeof(valid) / sizeof(valid[0]))];
+				memcpy(&s[j], p, strlen(p));
+				j += strlen(p);
+			}
+			len = j;
+		}
+		testRowCheck(i % 2 ? "random" : "valid", s, len);
+		free(s);
+	}
+}
+
+// 数字和空格组成的随机行，最后一行没有换行；查找和过滤的模式用数字串，匹配的疏密可以控制
+char *testDigits(size_t n)
+{
+	char *s = malloc(n + 1);
+	if (s == NULL)
+		die("malloc");
+	for (size_t i = 0; i < n; i++)
+	{
+		uint32_t r = testRand() % 64;
+		s[i] = r == 0 ? '\n' : r < 6 ? ' ' : '0' + r % 10;
+	}
+	s[n] = '\0';
+	return s;
+}
+
+// 处理后台加载和统计的通知，直到都结束
+void testSettle()
+{
+	while ((E.loader.active && !E.indexed) || E.search.active)
+	{
+		struct pollfd fds[2] = {{E.loader.notify[0], POLLIN, 0}, {E.search.notify[0], POLLIN, 0}};
+		poll(fds, 2, 100);
+		editorLoaderUpdate();
+		editorSearchUpdate();
+	}
+}
+
+// 随机插入和删除若干段数字与换行，返回编辑后的全文
+char *testEditDigits(int count, size_t *len)
+{
+	if (!editorBeginEdit())
+		die("editorBeginEdit");
+	for (int i = 0; i < count; i++)
+	{
+		size_t total = ptTotal();
+		size_t off = total > 1 ? testRand() % (total - 1) : 0;
+		int oldrows = E.numrows;
+		E.undo.sealed = true;
+		if (testRand() % 2 || total < 2)
+		{
+			char *s = testDigits(1 + testRand() % 200);
+			editorInsert(off, s, strlen(s));
+			free(s);
+		}
+		else
+		{
+			size_t del = 1 + testRand() % 300;
+			editorDelete(off, off + del < total - 1 ? del : total - 1 - off);
+		}
+		editorEndEdit(ptLineAt(off), oldrows);
+	}
+	*len = ptTotal();
+	char *text = malloc(*len + 1);
+	if (text == NULL)
+		die("malloc");
+	ptCopy(E.pt.root, 0, *len, text);
+	text[*len] = '\0';
+	return text;
+}
+
+// 查找：后台统计的总数，以及向后、向前逐个跳转的位置都与 memmem 的结果一致
+void testFindCheck(const char *what, const char *text, size_t len, const char *q)
+{
+	size_t m = strlen(q);
+	editorSearchStart(q);
+	testSettle();
+	size_t *offs = NULL;
+	size_t n = 0;
+	for (const char *p = text; (p = memmem(p, text + len - p, q, m)) != NULL; p++)
+	{
+		offs = realloc(offs, sizeof(size_t) * (n + 1));
+		if (offs == NULL)
+			die("realloc");
+		offs[n++] = p - text;
+	}
+	if (E.search.count != n)
+		testFail("find %s \"%s\": counted %zu matches, expected %zu", what, q, E.search.count, n);
+
+	// 最多检查 300 次跳转，再多走一步回绕到另一端
+	size_t steps = n < 300 ? n + 1 : 300;
+	size_t from = 0, at;
+	for (size_t i = 0; i < steps; i++)
+	{
+		bool found = editorSearchFind(q, m, from, true, &at);
+		if (n == 0 ? found : !found || at != offs[i % n])
+		{
+			testFail("find %s \"%s\": jump %zu forward found %zu, expected %zu", what, q, i,
+					 found ? at : (size_t)-1, n ? offs[i % n] : (size_t)-1);
+			break;
+		}
+		from = at + 1;
+	}
+	from = editorTextSize();
+	for (size_t i = 0; n > 0 && i < steps; i++)
+	{
+		bool found = editorSearchFind(q, m, from, false, &at);
+		if (!found || at != offs[n - 1 - i % n])
+		{
+			testFail("find %s \"%s\": jump %zu backward found %zu, expected %zu", what, q, i,
+					 found ? at : (size_t)-1, offs[n - 1 - i % n]);
+			break;
+		}
+		from = at;
+	}
+	editorSearchStop();
+	free(offs);
+}
+
+// 查找：普通模式、加载中的视图模式和编辑过的文档，常见和稀少的模式各一个
+void testFind()
+{
+	// 终端输入就绪时查找会提前放弃，换成一个没有数据的管道
+	int fds[2];
+	if (pipe(fds) == -1 || dup2(fds[0], STDIN_FILENO) == -1)
+		die("pipe");
+
+	size_t len = (5 << 20) + testRand() % 4096;
+	char *text = testDigits(len);
+	char *path = testTempFile(0, text, len, "");
+	const char *queries[] = {"12", "31415"};
+
+	for (int i = 0; i < 2; i++)
+	{
+		editorOpen(path, false);
+		editorIndexRows();
+		testFindCheck("owned", text, len, queries[i]);
+
+		// 还没有发布任何行时开始统计和查找，结果随加载进度补全
+		editorOpen(path, true);
+		size_t at;
+		if (editorSearchFind(queries[i], strlen(queries[i]), 0, true, &at))
+			testFail("find view: match at %zu before any row was published", at);
+		testFindCheck("view", text, len, queries[i]);
+	}
+
+	editorOpen(path, true);
+	editorLoaderWait();
+	size_t elen;
+	char *edited = testEditDigits(200, &elen);
+	for (int i = 0; i < 2; i++)
+		testFindCheck("edited", edited, elen, queries[i]);
+	free(edited);
+
+	editorFreeRows();
+	unlink(path);
+	free(path);
+	free(text);
+}
+
+// 过滤：结果与逐行 strstr 一致
+void testFilterCheck(const char *what, const char *text, size_t len, const char *pattern)
+{
+	testSettle();
+	int row = 0, n = 0;
+	bool ok = E.filter.active && strcmp(E.filter.pattern, pattern) == 0;
+	for (size_t off = 0; ok && off < len; row++)
+	{
+		const char *nl = memchr(text + off, '\n', len - off);
+		size_t end = nl ? (size_t)(nl - text) : len;
+		if (memmem(text + off, end - off, pattern, strlen(pattern)))
+		{
+			if (n >= E.filter.nrows || E.filter.rows[n] != row)
+			{
+				testFail("filter %s \"%s\": match %d is row %d, expected row %d", what, pattern, n,
+						 n < E.filter.nrows ? E.filter.rows[n] : -1, row);
+				return;
+			}
+			n++;
+		}
+		off = end + 1;
+	}
+	if (!ok || n != E.filter.nrows)
+		testFail("filter %s \"%s\": %d rows, expected %d", what, pattern, E.filter.nrows, n);
+}
+
+// 过滤：模式逐步变长时在上一次的结果中筛选，变短时重新扫描；
+// 视图模式在加载中开始过滤，之后发布的行随加载加入
+void testFilter()
+{
+	size_t len = (5 << 20) + testRand() % 4096;
+	char *text = testDigits(len);
+	char *path = testTempFile(0, text, len, "");
+	const char *refine[] = {"1", "12", "123", "2"};
+
+	editorOpen(path, false);
+	editorIndexRows();
+	for (int i = 0; i < 4; i++)
+	{
+		editorFilterBuild(refine[i]);
+		testFilterCheck("owned", text, len, refine[i]);
+	}
+	editorFilterClear();
+
+	// 第一次过滤时还没有发布任何行，第二次在发布了一段之后
+	editorOpen(path, true);
+	editorFilterBuild(refine[0]);
+	struct pollfd fd = {E.loader.notify[0], POLLIN, 0};
+	poll(&fd, 1, -1);
+	editorLoaderUpdate();
+	editorFilterBuild(refine[1]);
+	testFilterCheck("view", text, len, refine[1]);
+	for (int i = 2; i < 4; i++)
+	{
+		editorFilterBuild(refine[i]);
+		testFilterCheck("view", text, len, refine[i]);
+	}
+	editorFilterClear();
+
+	editorOpen(path, true);
+	editorLoaderWait();
+	size_t elen;
+	char *edited = testEditDigits(200, &elen);
+	for (int i = 0; i < 4; i++)
+	{
+		editorFilterBuild(refine[i]);
+		testFilterCheck("edited", edited, elen, refine[i]);
+	}
+	editorFilterClear();
+	free(edited);
+
+	editorFreeRows();
+	unlink(path);
+	free(path);
+	free(text);
+}
+
+// 分配器：超过块大小的请求单独成块，不打断当前块的小分配
+void testArena()
+{
+	arena a = {NULL, 0};
+	char *small = arenaAlloc(&a, 100);
+	char *big = arenaAlloc(&a, VEITOR_ARENA_BLOCK + 1);
+	char *next = arenaAlloc(&a, 100);
+	if (next != small + 100)
+		testFail("arena: small allocation after an oversized one left the current block");
+	if (a.total != 2 * VEITOR_ARENA_BLOCK + 1)
+		testFail("arena: %zu bytes in blocks, expected %d", a.total, 2 * VEITOR_ARENA_BLOCK + 1);
+	memset(big, 0, VEITOR_ARENA_BLOCK + 1);
+
+	// 有序分配总是在头部开新块
+	arena o = {NULL, 0};
+	arenaAllocOrdered(&o, 100);
+	char *last = arenaAllocOrdered(&o, VEITOR_ARENA_BLOCK + 1);
+	if (o.head->data != last)
+		testFail("arena: ordered allocation is not in the head block");
+	arenaFree(&a);
+	arenaFree(&o);
+}
+
+// 跟随：一行分多次写入时只读取新增的部分，未结束的行不在 rowarena 中留下副本
+void testFollow()
+{
+	char *path = testTempFile(0, "first\nsec", 9, "");
+	editorOpen(path, false);
+	E.follow.active = true;
+	int fd = open(path, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		die("open");
+	struct abuf want = ABUF_INIT;
+	abAppend(&want, "sec", 3);
+	size_t arena = E.rowarena.total;
+
+	for (int i = 0; i < 2000; i++)
+	{
+		// 片段末尾有时是 \r，显示时去掉，后续内容到来时恢复
+		char piece[64];
+		int n = 1 + testRand() % 48;
+		for (int j = 0; j < n; j++)
+			piece[j] = testRand() % 8 == 0 ? '\r' : 'a' + testRand() % 26;
+		if (write(fd, piece, n) != n)
+			die("write");
+		abAppend(&want, piece, n);
+		editorFollowCheck();
+
+		int len = want.len;
+		while (len > 0 && want.b[len - 1] == '\r')
+			len--;
+		erow *row = E.numrows == 2 ? editorRowAt(1) : NULL;
+		if (row == NULL || row->size != len || memcmp(row->chars, want.b, len) != 0 || row->chars[len] != '\0')
+		{
+			testFail("follow: step %d, %d rows, last row does not match the unterminated line", i, E.numrows);
+			break;
+		}
+	}
+	if (E.rowarena.total != arena)
+		testFail("follow: row arena grew from %zu to %zu bytes for one unterminated line", arena, E.rowarena.total);
+
+	// 换行到达后整行复制一次，之后的行照常追加
+	if (write(fd, "\r\nthird\n", 8) != 8)
+		die("write");
+	editorFollowCheck();
+	int len = want.len;
+	while (len > 0 && want.b[len - 1] == '\r')
+		len--;
+	if (E.numrows != 3 || editorRowAt(1)->size != len || memcmp(editorRowAt(1)->chars, want.b, len) != 0 ||
+		strcmp(editorRowAt(2)->chars, "third") != 0)
+		testFail("follow: %d rows after the newline, expected 3", E.numrows);
+
+	E.follow.active = false;
+	close(fd);
+	abFree(&want);
+	editorFreeRows();
+	unlink(path);
+	free(path);
+}
+
+void testScan()
+{
+	testKernels kernels[3];
+	int nk = 0;
+	kernels[nk++] = (testKernels){"scalar", scanColumnsScalar, scanClassifyScalar,
+								  scanCountTabsScalar, scanFindScalar};
+#ifdef VEITOR_X86
+	kernels[nk++] = (testKernels){"sse2", scanColumnsSSE2, scanClassifySSE2,
+								  scanCountTabsSSE2, scanFindSSE2};
+	if (__builtin_cpu_supports("avx2"))
+		kernels[nk++] = (testKernels){"avx2", scanColumnsAVX2, scanClassifyAVX2,
+									  scanCountTabsAVX2, scanFindAVX2};
+#endif
+	for (int i = 1; i < nk; i++)
+	{
+		testScanKernels(&kernels[i]);
+		printf("scan: %s checked against scalar\n", kernels[i].name);
+	}
+	testLineIndex();
+}
+
+int main(int argc, char *args[])
+{
+	static const struct { const char *name; void (*fn)(); } tests[] = {
+		{"scan", testScan},
+		{"loader", testLoader},
+		{"piecetable", testPieceTable},
+		{"syntax", testSyntax},
+		{"rows", testRows},
+		{"arena", testArena},
+		{"follow", testFollow},
+		{"cache", testCache},
+		{"find", testFind},
+		{"filter", testFilter},
+	};
+	int ntests = sizeof(tests) / sizeof(tests[0]);
+
+	// 多个工作线程，让行索引拆分的任务真正并行
+	setenv("VEITOR_THREADS", "4", 0);
+	// 不读写用户的行索引缓存
+	setenv("VEITOR_CACHE", "0", 1);
+	initEditor();
+	for (int i = 0; i < ntests; i++)
+	{
+		bool run = argc == 1;
+		for (int j = 1; j < argc; j++)
+			run |= strcmp(args[j], tests[i].name) == 0;
+		if (!run)
+			continue;
+		testState = 0x9e3779b97f4a7c15ULL;
+		int before = testFailures;
+		tests[i].fn();
+		printf("%s: %s\n", tests[i].name, testFailures == before ? "ok" : "FAILED");
+	}
+	return testFailures != 0;
+}
+
+#pragma endregion